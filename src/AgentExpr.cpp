@@ -0,0 +1,287 @@
+#include "AgentExpr.h"
+
+#include "RVDebug.h"
+#include "SoftBreak.h"
+#include "utils.h"
+
+// Bytecodes, numbered as in GDB's ax.def. The ones we don't list here (floats,
+// printf, state variables) make eval() fail.
+enum {
+  AX_ADD           = 0x02,
+  AX_SUB           = 0x03,
+  AX_MUL           = 0x04,
+  AX_DIV_SIGNED    = 0x05,
+  AX_DIV_UNSIGNED  = 0x06,
+  AX_REM_SIGNED    = 0x07,
+  AX_REM_UNSIGNED  = 0x08,
+  AX_LSH           = 0x09,
+  AX_RSH_SIGNED    = 0x0A,
+  AX_RSH_UNSIGNED  = 0x0B,
+  AX_TRACE         = 0x0C,
+  AX_TRACE_QUICK   = 0x0D,
+  AX_LOG_NOT       = 0x0E,
+  AX_BIT_AND       = 0x0F,
+  AX_BIT_OR        = 0x10,
+  AX_BIT_XOR       = 0x11,
+  AX_BIT_NOT       = 0x12,
+  AX_EQUAL         = 0x13,
+  AX_LESS_SIGNED   = 0x14,
+  AX_LESS_UNSIGNED = 0x15,
+  AX_EXT           = 0x16,
+  AX_REF8          = 0x17,
+  AX_REF16         = 0x18,
+  AX_REF32         = 0x19,
+  AX_REF64         = 0x1A,
+  AX_IF_GOTO       = 0x20,
+  AX_GOTO          = 0x21,
+  AX_CONST8        = 0x22,
+  AX_CONST16       = 0x23,
+  AX_CONST32       = 0x24,
+  AX_CONST64       = 0x25,
+  AX_REG           = 0x26,
+  AX_END           = 0x27,
+  AX_DUP           = 0x28,
+  AX_POP           = 0x29,
+  AX_ZERO_EXT      = 0x2A,
+  AX_SWAP          = 0x2B,
+  AX_TRACEV        = 0x2E,
+  AX_TRACENZ       = 0x2F,
+  AX_TRACE16       = 0x30,
+  AX_PICK          = 0x32,
+  AX_ROT           = 0x33,
+};
+
+static const int reg_pc = 32; // GDB's register number for pc
+
+//------------------------------------------------------------------------------
+// Values on the stack are 64 bits wide like GDB's, and immediates are big
+// endian. Binary operators pop 'b' and replace the new top with the result.
+
+bool AgentExpr::eval(const uint8_t* code, int len, int64_t& result, TraceSink* sink) {
+  int64_t stack[stack_max];
+  int sp = 0;
+  int pc = 0;
+
+  for (int steps = 0; steps < step_max; steps++) {
+    if (pc >= len) break;
+    uint8_t op = code[pc++];
+
+    // Immediate operand sizes
+    int imm_size = 0;
+    switch (op) {
+      case AX_EXT: case AX_ZERO_EXT: case AX_TRACE_QUICK: case AX_PICK: case AX_CONST8:
+        imm_size = 1; break;
+      case AX_IF_GOTO: case AX_GOTO: case AX_CONST16: case AX_REG: case AX_TRACEV: case AX_TRACE16:
+        imm_size = 2; break;
+      case AX_CONST32:
+        imm_size = 4; break;
+      case AX_CONST64:
+        imm_size = 8; break;
+    }
+    if (pc + imm_size > len) break;
+
+    uint64_t imm = 0;
+    for (int i = 0; i < imm_size; i++) imm = (imm << 8) | code[pc++];
+
+    // Stack depth in and out
+    int pops = 0, pushes = 0;
+    switch (op) {
+      case AX_CONST8: case AX_CONST16: case AX_CONST32: case AX_CONST64: case AX_REG:
+        pushes = 1; break;
+      case AX_DUP:
+        pops = 1; pushes = 2; break;
+      case AX_PICK:
+        pops = int(imm) + 1; pushes = pops + 1; break;
+      case AX_POP: case AX_IF_GOTO:
+        pops = 1; break;
+      case AX_TRACE: case AX_TRACENZ:
+        pops = 2; break;
+      case AX_SWAP:
+        pops = 2; pushes = 2; break;
+      case AX_ROT:
+        pops = 3; pushes = 3; break;
+      case AX_GOTO: case AX_TRACEV:
+        break;
+      case AX_END: case AX_LOG_NOT: case AX_BIT_NOT: case AX_EXT: case AX_ZERO_EXT:
+      case AX_REF8: case AX_REF16: case AX_REF32: case AX_REF64:
+      case AX_TRACE_QUICK: case AX_TRACE16:
+        pops = 1; pushes = 1; break;
+      default:
+        pops = 2; pushes = 1; break;
+    }
+    if (sp < pops || sp - pops + pushes > stack_max) break;
+
+    int64_t& a = stack[sp ? sp - 1 : 0]; // Top, for ops that pop at least one
+    int64_t  b = a;
+
+    switch (op) {
+      // Binary operators
+      case AX_ADD:           sp--; stack[sp - 1] += b; break;
+      case AX_SUB:           sp--; stack[sp - 1] -= b; break;
+      case AX_MUL:           sp--; stack[sp - 1] *= b; break;
+      case AX_LSH:           sp--; stack[sp - 1] = uint64_t(stack[sp - 1]) << (b & 63); break;
+      case AX_RSH_SIGNED:    sp--; stack[sp - 1] >>= (b & 63); break;
+      case AX_RSH_UNSIGNED:  sp--; stack[sp - 1] = uint64_t(stack[sp - 1]) >> (b & 63); break;
+      case AX_BIT_AND:       sp--; stack[sp - 1] &= b; break;
+      case AX_BIT_OR:        sp--; stack[sp - 1] |= b; break;
+      case AX_BIT_XOR:       sp--; stack[sp - 1] ^= b; break;
+      case AX_EQUAL:         sp--; stack[sp - 1] = stack[sp - 1] == b; break;
+      case AX_LESS_SIGNED:   sp--; stack[sp - 1] = stack[sp - 1] < b; break;
+      case AX_LESS_UNSIGNED: sp--; stack[sp - 1] = uint64_t(stack[sp - 1]) < uint64_t(b); break;
+
+      case AX_DIV_SIGNED:
+      case AX_DIV_UNSIGNED:
+      case AX_REM_SIGNED:
+      case AX_REM_UNSIGNED: {
+        if (b == 0) {
+          LOG_R("AgentExpr::eval - Division by zero\n");
+          return false;
+        }
+        sp--;
+        int64_t& x = stack[sp - 1];
+        if      (op == AX_DIV_SIGNED)   x = x / b;
+        else if (op == AX_DIV_UNSIGNED) x = uint64_t(x) / uint64_t(b);
+        else if (op == AX_REM_SIGNED)   x = x % b;
+        else                            x = uint64_t(x) % uint64_t(b);
+        break;
+      }
+
+      // Unary operators
+      case AX_LOG_NOT: a = !a; break;
+      case AX_BIT_NOT: a = ~a; break;
+
+      case AX_EXT:
+        if (imm && imm < 64) a = int64_t(uint64_t(a) << (64 - imm)) >> (64 - imm);
+        break;
+      case AX_ZERO_EXT:
+        if (imm && imm < 64) a &= (uint64_t(1) << imm) - 1;
+        break;
+
+      case AX_REF8:  a = read_mem(uint32_t(a), 1); break;
+      case AX_REF16: a = read_mem(uint32_t(a), 2); break;
+      case AX_REF32: a = read_mem(uint32_t(a), 4); break;
+      case AX_REF64: a = read_mem(uint32_t(a), 8); break;
+
+      // Stack manipulation
+      case AX_CONST8:
+      case AX_CONST16:
+      case AX_CONST32:
+      case AX_CONST64:
+        stack[sp++] = int64_t(imm);
+        break;
+
+      case AX_REG: {
+        int64_t value = 0;
+        if (!read_reg(int(imm), value)) return false;
+        stack[sp++] = value;
+        break;
+      }
+
+      case AX_DUP:  stack[sp] = a; sp++; break;
+      case AX_POP:  sp--; break;
+      case AX_PICK: stack[sp] = stack[sp - 1 - imm]; sp++; break;
+
+      case AX_SWAP:
+        stack[sp - 1] = stack[sp - 2];
+        stack[sp - 2] = b;
+        break;
+
+      // a b c => c a b
+      case AX_ROT: {
+        int64_t c = stack[sp - 1];
+        stack[sp - 1] = stack[sp - 2];
+        stack[sp - 2] = stack[sp - 3];
+        stack[sp - 3] = c;
+        break;
+      }
+
+      // Flow control - offsets are from the start of the expression
+      case AX_IF_GOTO:
+        sp--;
+        if (stack[sp]) pc = int(imm);
+        break;
+      case AX_GOTO:
+        pc = int(imm);
+        break;
+
+      // Data collection, only used by tracepoints
+      case AX_TRACE:
+        sp -= 2;
+        if (sink) sink->on_trace_mem(uint32_t(stack[sp]), int(b));
+        break;
+      case AX_TRACE_QUICK:
+      case AX_TRACE16:
+        if (sink) sink->on_trace_mem(uint32_t(a), int(imm));
+        break;
+      case AX_TRACENZ: {
+        sp -= 2;
+        if (!sink) break;
+        uint32_t addr = uint32_t(stack[sp]);
+        int limit = b < string_max ? int(b) : string_max;
+        int size = 0;
+        while (size < limit && read_mem(addr + size, 1)) size++;
+        if (size < limit) size++; // Keep the terminator
+        sink->on_trace_mem(addr, size);
+        break;
+      }
+      case AX_TRACEV:
+        break;
+
+      case AX_END:
+        result = a;
+        return true;
+
+      default:
+        LOG_R("AgentExpr::eval - Unsupported bytecode 0x%02x\n", op);
+        return false;
+    }
+  }
+
+  LOG_R("AgentExpr::eval - Bad expression at offset %d\n", pc);
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// REF reads clobber a0/a1 on the hart, so registers come from RVDebug's saved
+// copies or a condition could see a different a0 depending on operand order.
+
+bool AgentExpr::read_reg(int reg, int64_t& value) {
+  if (reg == reg_pc) {
+    value = rvd->get_dpc();
+    return true;
+  }
+  if (reg >= 0 && reg < rvd->get_gpr_count()) {
+    value = reg ? rvd->get_user_gpr(reg) : 0;
+    return true;
+  }
+  LOG_R("AgentExpr::read_reg - Bad register %d\n", reg);
+  return false;
+}
+
+//----------
+// Reads go through SoftBreak's overlay so conditions never see our ebreaks.
+
+int64_t AgentExpr::read_mem(uint32_t addr, int size) {
+  union {
+    uint8_t  b[8];
+    uint16_t h;
+    uint32_t w[2];
+    uint64_t d;
+  } data = {};
+
+  if (size == 1) {
+    data.b[0] = rvd->get_mem_u8(addr);
+  }
+  else if (size == 2) {
+    data.h = rvd->get_mem_u16(addr);
+  }
+  else {
+    data.w[0] = rvd->get_mem_u32(addr);
+    if (size == 8) data.w[1] = rvd->get_mem_u32(addr + 4);
+  }
+
+  soft->overlay_clean(addr, data.b, size);
+  return int64_t(data.d);
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,44 @@
+// Evaluator for GDB agent expressions - the bytecode GDB sends with
+// conditional breakpoints (and tracepoints). Registers and memory are read
+// from the halted target through RVDebug.
+//
+// See "Agent Expressions" in the GDB manual for the bytecode reference.
+
+#pragma once
+#include <stdint.h>
+
+struct RVDebug;
+struct SoftBreak;
+
+//------------------------------------------------------------------------------
+// Receives the memory ranges that trace bytecodes ask to collect.
+
+struct TraceSink {
+  virtual void on_trace_mem(uint32_t addr, int size) = 0;
+};
+
+//------------------------------------------------------------------------------
+
+struct AgentExpr {
+  AgentExpr(RVDebug* rvd, SoftBreak* soft) : rvd(rvd), soft(soft) {}
+
+  // Runs 'code' and returns the value on top of the stack at 'end'. Returns
+  // false if the bytecode is malformed, overflows the stack, runs too long or
+  // uses something we don't support (floats, printf, state variables).
+  // Trace bytecodes report what they collect to 'sink', if there is one.
+  bool eval(const uint8_t* code, int len, int64_t& result, TraceSink* sink = nullptr);
+
+private:
+
+  bool read_reg(int reg, int64_t& value);
+  int64_t read_mem(uint32_t addr, int size);
+
+  static const int stack_max = 32;
+  static const int step_max = 1000; // Stops runaway gotos
+  static const int string_max = 256; // Longest string tracenz collects
+
+  RVDebug* rvd;
+  SoftBreak* soft;
+};
+
+//------------------------------------------------------------------------------
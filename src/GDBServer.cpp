@@ -4,14 +4,16 @@
 #include "SoftBreak.h"
 #include "RVDebug.h"
 #include "WCHFlash.h"
+#include "AgentExpr.h"
+#include "Trace.h"
+#include "debug_defines.h"
 
 #include <ctype.h>
+#include <string.h>
 #include "hardware/timer.h"
 
 //#define DEBUG_REMOTE
 
-static const int breakpoint_check_interval = 100000; // 100 msec
-
 uint32_t swap(uint32_t x) {
   uint32_t a = (x >>  0) & 0xFF;
   uint32_t b = (x >>  8) & 0xFF;
@@ -21,29 +23,52 @@ uint32_t swap(uint32_t x) {
   return (a << 24) | (b << 16) | (c << 8) | (d << 0);
 }
 
-const char* memory_map = R"(<?xml version="1.0"?>
+const char* memory_map_format = R"(<?xml version="1.0"?>
 <!DOCTYPE memory-map PUBLIC "+//IDN gnu.org//DTD GDB Memory Map V1.0//EN" "http://sourceware.org/gdb/gdb-memory-map.dtd">
 <memory-map>
-  <memory type="flash" start="0x00000000" length="0x4000">
-    <property name="blocksize">64</property>
+  <memory type="flash" start="0x%08x" length="0x%x">
+    <property name="blocksize">%d</property>
   </memory>
-  <memory type="ram" start="0x20000000" length="0x800"/>
+  <memory type="ram" start="0x%08x" length="0x%x"/>
 </memory-map>
 )";
 
+// Target description - just the integer registers and pc. Chips with the
+// RV32E core only have x0-x15, and telling GDB so keeps it from probing for
+// the rest. pc keeps GDB's usual register number (32) either way.
+
+const char* target_xml_header = R"(<?xml version="1.0"?>
+<!DOCTYPE target SYSTEM "gdb-target.dtd">
+<target version="1.0">
+  <architecture>riscv:rv32</architecture>
+  <feature name="org.gnu.gdb.riscv.cpu">
+)";
+
+const char* target_xml_footer = R"(    <reg name="pc" bitsize="32" type="code_ptr" regnum="32"/>
+  </feature>
+</target>
+)";
+
 //------------------------------------------------------------------------------
 
-GDBServer::GDBServer(RVDebug* rvd, WCHFlash* flash, SoftBreak* soft) {
+GDBServer::GDBServer(const WCHChip& chip, RVDebug* rvd, WCHFlash* flash, SoftBreak* soft) {
+  this->chip = chip;
   this->rvd = rvd;
   this->flash = flash;
   this->soft = soft;
+  this->agent = new AgentExpr(rvd, soft);
+  this->trace = new Trace(rvd, soft, agent);
   this->page_cache = new uint8_t[flash->get_page_size()];
+  this->page_mask = new uint8_t[flash->get_page_size()];
+  this->page_readback = new uint8_t[flash->get_page_size()];
+  this->erase_map = new uint8_t[flash->get_page_count()];
 }
 
 void GDBServer::reset() {
-  this->page_base = -1;
-  this->page_bitmap = 0;
-  for (int i = 0; i < flash->get_page_size(); i++) this->page_cache[i] = 0xFF;
+  discard_flash_cache();
+  for (int i = 0; i < flash->get_page_count(); i++) this->erase_map[i] = 0;
+  render_memory_map();
+  render_target_xml();
 }
 
 void GDBServer::dump() {
@@ -82,13 +107,24 @@ const GDBServer::handler GDBServer::handler_tab[] = {
   { "p",     &GDBServer::handle_p },
   { "P",     &GDBServer::handle_P },
   { "q",     &GDBServer::handle_q },
+  { "Q",     &GDBServer::handle_Q },
+  { "qT",    &GDBServer::handle_trace },
+  { "QT",    &GDBServer::handle_trace },
   { "s",     &GDBServer::handle_s },
   { "R",     &GDBServer::handle_R },
   { "v",     &GDBServer::handle_v },
+  { "x",     &GDBServer::handle_x },
+  { "X",     &GDBServer::handle_X },
   { "z0",    &GDBServer::handle_z0 },
   { "Z0",    &GDBServer::handle_Z0 },
   { "z1",    &GDBServer::handle_z1 },
   { "Z1",    &GDBServer::handle_Z1 },
+  { "z2",    &GDBServer::handle_watch },
+  { "Z2",    &GDBServer::handle_watch },
+  { "z3",    &GDBServer::handle_watch },
+  { "Z3",    &GDBServer::handle_watch },
+  { "z4",    &GDBServer::handle_watch },
+  { "Z4",    &GDBServer::handle_watch },
 };
 
 const int GDBServer::handler_count = sizeof(GDBServer::handler_tab) / sizeof(GDBServer::handler_tab[0]);
@@ -99,7 +135,7 @@ const int GDBServer::handler_count = sizeof(GDBServer::handler_tab) / sizeof(GDB
 void GDBServer::handle_questionmark() {
   //  SIGINT = 2
   recv.take('?');
-  send.set_packet("T05");
+  put_stop_reply();
   next_state = SEND_PREFIX;
 }
 
@@ -124,19 +160,39 @@ void GDBServer::handle_c() {
     soft->set_dpc(addr);
   }
 
-  // If we did not actually resume because we immediately hit a breakpoint,
-  // respond with a "hit breakpoint" message. Otherwise we do not reply until
-  // the hart stops.
+  resume_target();
+}
+
+//----------
+// If we did not actually resume because we immediately hit a breakpoint,
+// respond with a "hit breakpoint" message. Otherwise we do not reply until
+// the hart stops.
+
+void GDBServer::resume_target() {
+  refresh_watches();
+  last_watch_check = time_us_32();
+  continue_target();
+}
 
-  if (!soft->resume()) {
-    LOG("soft->resume() returned false\n");
-    send.set_packet("T05");
-    next_state = SEND_PREFIX;
-  }
-  else {
-    LOG("soft->resume() returned true\n");
-    next_state = RUNNING;
+//----------
+// Resuming steps one instruction first, which can land on another breakpoint.
+// If that one's condition is false we keep going, up to a point.
+
+void GDBServer::continue_target() {
+  for (int i = 0; i < cond_skip_max; i++) {
+    if (soft->resume()) {
+      LOG("soft->resume() returned true\n");
+      poll_interval = poll_min;
+      last_halt_check = time_us_32();
+      next_state = RUNNING;
+      return;
+    }
+    if (should_stop(rvd->get_dpc())) break;
   }
+
+  LOG("soft->resume() returned false\n");
+  put_stop_reply();
+  next_state = SEND_PREFIX;
 }
 
 //------------------------------------------------------------------------------
@@ -146,6 +202,10 @@ void GDBServer::handle_D() {
 
   recv.take('D');
   LOG("GDB detaching\n");
+
+  // Don't leave lazily-unpatched breakpoints behind on the chip.
+  if (soft->is_halted()) soft->unpatch_flash();
+
   send.set_packet("OK");
   //next_state = DISCONNECTED;
   next_state = SEND_PREFIX;
@@ -157,16 +217,20 @@ void GDBServer::handle_D() {
 void GDBServer::handle_g() {
   recv.take('g');
 
-  if (!recv.error) {
-    uint32_t buf1[17];
+  if (!recv.error && trace->get_frame() != -1) {
+    put_frame_regs(-1);
+  }
+  else if (!recv.error) {
+    uint32_t buf1[33];
+    int gpr_count = rvd->get_gpr_count();
 
-    for (int i = 0; i < rvd->get_gpr_count(); i++) {
-      buf1[i] = rvd->get_gpr(i);
+    for (int i = 0; i < gpr_count; i++) {
+      buf1[i] = rvd->get_user_gpr(i);
     }
-    buf1[16] = rvd->get_dpc();
+    buf1[gpr_count] = rvd->get_dpc();
 
     send.start_packet();
-    for (int i = 0; i < 17; i++) {
+    for (int i = 0; i < gpr_count + 1; i++) {
       send.put_hex_u32(buf1[i]);
     }
     send.end_packet();
@@ -184,7 +248,7 @@ void GDBServer::handle_G() {
   recv.take('G');
 
   for(int i = 0; i < rvd->get_gpr_count(); i++) {
-    rvd->set_gpr(i, recv.take_hex(8));
+    rvd->set_user_gpr(i, recv.take_hex(8));
   }
   rvd->set_dpc(recv.take_hex(8));
 
@@ -228,36 +292,24 @@ void GDBServer::handle_m() {
     return;
   }
 
+  // GDB will ask again for whatever doesn't fit.
+  int max = (send.buf_size - 1) / 2;
+  if (len > max) len = max;
+
+  if (trace->get_frame() != -1) {
+    put_frame_mem(src, len, false);
+    return;
+  }
+
   send.start_packet();
-  uint32_t buf[256];
 
+  uint32_t buf[256];
   while (len) {
-    if (len == 2) {
-      auto data = rvd->get_mem_u16(src);
-      send.put_hex_u16(data);
-      src += 2;
-      len -= 2;
-    }
-    else if (len == 4) {
-      auto data = rvd->get_mem_u32(src);
-      send.put_hex_u32(data);
-      src += 4;
-      len -= 4;
-    }
-    else if ((src & 3) == 0 && len >= 4) {
-      int chunk = len & ~3;
-      if (chunk > sizeof(buf)) chunk = sizeof(buf);
-      rvd->get_block_aligned(src, buf, chunk);
-      send.put_hex_blob(buf, chunk);
-      src += chunk;
-      len -= chunk;
-    }
-    else {
-      auto x = rvd->get_mem_u8(src);
-      send.put_hex_u8(x >> 0);
-      src += 1;
-      len -= 1;
-    }
+    int chunk = len > (int)sizeof(buf) ? sizeof(buf) : len;
+    read_mem(src, (uint8_t*)buf, chunk);
+    send.put_hex_blob(buf, chunk);
+    src += chunk;
+    len -= chunk;
   }
 
   send.end_packet();
@@ -282,6 +334,15 @@ void GDBServer::handle_M() {
     return;
   }
 
+  // The data was already written while the packet was arriving.
+  if (stream_mode == STREAM_MEM_HEX) {
+    flush_stream();
+    bool ok = !stream_error && stream_nibble == -1 && stream_count == (int)len;
+    send.set_packet(ok ? "OK" : "E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
+
   uint32_t buf[256];
 
   while (len) {
@@ -305,6 +366,71 @@ void GDBServer::handle_M() {
   next_state = SEND_PREFIX;
 }
 
+//------------------------------------------------------------------------------
+// Read memory, binary reply - "x<addr>,<len>"
+
+void GDBServer::handle_x() {
+  recv.take('x');
+  int src = recv.take_hex();
+  recv.take(',');
+  int len = recv.take_hex();
+
+  if (recv.error) {
+    LOG_R("\nhandle_x %x %x - recv.error '%s'\n", src, len, recv.buf);
+    send.set_packet("");
+    return;
+  }
+
+  // GDB will ask again for whatever doesn't fit.
+  int max = send.buf_size - 2;
+  if (len > max) len = max;
+
+  if (trace->get_frame() != -1) {
+    put_frame_mem(src, len, true);
+    return;
+  }
+
+  send.start_packet();
+  send.put('b');
+
+  uint32_t buf[256];
+  while (len) {
+    int chunk = len > (int)sizeof(buf) ? sizeof(buf) : len;
+    read_mem(src, (uint8_t*)buf, chunk);
+    send.put_blob(buf, chunk);
+    src += chunk;
+    len -= chunk;
+  }
+
+  send.end_packet();
+  next_state = SEND_PREFIX;
+}
+
+//------------------------------------------------------------------------------
+// Write memory, binary payload - "X<addr>,<len>:<data>"
+// The payload was already streamed out to the target by put_payload(). GDB
+// probes for X support by sending a zero-length write.
+
+void GDBServer::handle_X() {
+  recv.take('X');
+  uint32_t dst = recv.take_hex();
+  recv.take(',');
+  uint32_t len = recv.take_hex();
+  recv.take(':');
+
+  if (recv.error || stream_mode != STREAM_MEM_BIN) {
+    LOG_R("\nhandle_X %x %x - bad packet '%s'\n", dst, len, recv.buf);
+    recv.cursor2 = recv.buf + recv.size;
+    send.set_packet("E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
+
+  flush_stream();
+  send.set_packet(stream_count == (int)len ? "OK" : "E01");
+  next_state = SEND_PREFIX;
+}
+
 //------------------------------------------------------------------------------
 // Read the value of register N
 
@@ -313,14 +439,22 @@ void GDBServer::handle_p() {
   int gpr = recv.take_hex();
 
   if (!recv.error) {
-    send.start_packet();
-    if (gpr == rvd->get_gpr_count()) {
+    if (trace->get_frame() != -1) {
+      put_frame_regs(gpr);
+    }
+    else if (gpr == reg_pc) {
+      send.start_packet();
       send.put_hex_u32(rvd->get_dpc());
+      send.end_packet();
+    }
+    else if (gpr < rvd->get_gpr_count()) {
+      send.start_packet();
+      send.put_hex_u32(rvd->get_user_gpr(gpr));
+      send.end_packet();
     }
     else {
-      send.put_hex_u32(rvd->get_gpr(gpr));
+      send.set_packet("E01");
     }
-    send.end_packet();
   }
 
   next_state = SEND_PREFIX;
@@ -336,13 +470,17 @@ void GDBServer::handle_P() {
   unsigned int val = recv.take_hex();
 
   if (!recv.error) {
-    if (gpr == rvd->get_gpr_count()) {
+    if (gpr == reg_pc) {
       rvd->set_dpc(val);
+      send.set_packet("OK");
+    }
+    else if (gpr < rvd->get_gpr_count()) {
+      rvd->set_user_gpr(gpr, val);
+      send.set_packet("OK");
     }
     else {
-      rvd->set_gpr(gpr, val);
+      send.set_packet("E01");
     }
-    send.set_packet("OK");
   }
 
   next_state = SEND_PREFIX;
@@ -384,7 +522,12 @@ void GDBServer::handle_q() {
   else if (recv.match_prefix("qSupported")) {
     // FIXME we're ignoring the contents of qSupported
     recv.cursor2 = recv.buf + recv.size;
-    send.set_packet("PacketSize=32768;qXfer:memory-map:read+");
+    // PacketSize is in hex and must match what our buffers can hold.
+    char features[128];
+    snprintf(features, sizeof(features),
+      "PacketSize=%x;qXfer:memory-map:read+;qXfer:features:read+;binary-upload+;QStartNoAckMode+;ConditionalBreakpoints+;tracenz+",
+      send.buf_size - 1);
+    send.set_packet(features);
   }
   else if (recv.match_prefix("qXfer:")) {
     if (recv.match_prefix("memory-map:read::")) {
@@ -396,10 +539,19 @@ void GDBServer::handle_q() {
         send.set_packet("E00");
       }
       else {
-        send.start_packet();
-        send.put_str("l");
-        send.put_str(memory_map);
-        send.end_packet();
+        put_xfer_chunk(memory_map, memory_map_size, offset, length);
+      }
+    }
+    else if (recv.match_prefix("features:read:target.xml:")) {
+      int offset = recv.take_hex();
+      recv.take(',');
+      int length = recv.take_hex();
+
+      if (recv.error) {
+        send.set_packet("E00");
+      }
+      else {
+        put_xfer_chunk(target_xml, target_xml_size, offset, length);
       }
     }
 
@@ -413,6 +565,69 @@ void GDBServer::handle_q() {
       soft->reset();
       send.set_packet("OK");
     }
+    // "watch <us>" sets how often sampled watchpoints are checked
+    else if (recv.match_prefix_hex("watch ")) {
+      char args[16] = {0};
+      for (int i = 0; i < (int)sizeof(args) - 1; i++) {
+        int hi = from_hex(recv.peek_char());
+        if (hi == -1) break;
+        recv.take_char();
+        int lo = from_hex(recv.take_char());
+        args[i] = (hi << 4) | lo;
+      }
+
+      int interval = 0;
+      if (atoi2(args, interval) && interval > 0) {
+        watch_interval = interval;
+        send.set_packet("OK");
+      }
+      else {
+        send.set_packet("E01");
+      }
+    }
+    // "poll <min_us> <max_us>" sets the halt polling range while running
+    else if (recv.match_prefix_hex("poll")) {
+      char args[32] = {0};
+      for (int i = 0; i < (int)sizeof(args) - 1; i++) {
+        int hi = from_hex(recv.peek_char());
+        if (hi == -1) break;
+        recv.take_char();
+        int lo = from_hex(recv.take_char());
+        args[i] = (hi << 4) | lo;
+      }
+
+      char* cursor = args;
+      int new_min = 0, new_max = 0;
+      while (*cursor == ' ') cursor++;
+      bool ok = atoi2(cursor, new_min);
+      while (*cursor && *cursor != ' ') cursor++;
+      while (*cursor == ' ') cursor++;
+      ok = ok && atoi2(cursor, new_max);
+
+      if (ok && new_min > 0 && new_max >= new_min) {
+        poll_min = new_min;
+        poll_max = new_max;
+        send.set_packet("OK");
+      }
+      else {
+        send.set_packet("E01");
+      }
+    }
+    // "lazy 0|1" turns lazy unpatching of breakpoints off/on
+    else if (recv.match_prefix_hex("lazy ")) {
+      int hi = from_hex(recv.take_char());
+      int lo = from_hex(recv.take_char());
+      char c = (hi << 4) | lo;
+      if (c == '0' || c == '1') {
+        soft->set_lazy_unpatch(c == '1');
+        // Turning it off while halted shouldn't leave ebreaks behind.
+        if (c == '0' && soft->is_halted()) soft->unpatch_flash();
+        send.set_packet("OK");
+      }
+      else {
+        send.set_packet("E01");
+      }
+    }
   }
 
 
@@ -425,6 +640,81 @@ void GDBServer::handle_q() {
   next_state = SEND_PREFIX;
 }
 
+//------------------------------------------------------------------------------
+// The memory map only depends on the chip geometry, so we render it once.
+
+void GDBServer::render_memory_map() {
+  memory_map_size = snprintf(memory_map, sizeof(memory_map), memory_map_format,
+    flash->get_flash_base(), flash->get_flash_size(), flash->get_page_size(),
+    chip.get_ram_base(), chip.ram_size);
+
+  if (memory_map_size >= (int)sizeof(memory_map)) {
+    LOG_R("GDBServer::render_memory_map() - Memory map truncated\n");
+    memory_map_size = sizeof(memory_map) - 1;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GDBServer::render_target_xml() {
+  int size = snprintf(target_xml, sizeof(target_xml), "%s", target_xml_header);
+
+  for (int i = 0; i < rvd->get_gpr_count() && size < (int)sizeof(target_xml); i++) {
+    const char* type = i == 1 ? "code_ptr" : i == 2 ? "data_ptr" : "int";
+    size += snprintf(target_xml + size, sizeof(target_xml) - size,
+      "    <reg name=\"x%d\" bitsize=\"32\" type=\"%s\" regnum=\"%d\"/>\n", i, type, i);
+  }
+
+  if (size < (int)sizeof(target_xml)) {
+    size += snprintf(target_xml + size, sizeof(target_xml) - size, "%s", target_xml_footer);
+  }
+
+  if (size >= (int)sizeof(target_xml)) {
+    LOG_R("GDBServer::render_target_xml() - Target description truncated\n");
+    size = sizeof(target_xml) - 1;
+  }
+  target_xml_size = size;
+}
+
+//------------------------------------------------------------------------------
+// Reply to a qXfer read with the requested window of the document. 'm' means
+// there's more to come, 'l' means this is the last chunk.
+
+void GDBServer::put_xfer_chunk(const char* doc, int doc_size, int offset, int length) {
+  if (offset >= doc_size) {
+    send.set_packet("l");
+    return;
+  }
+
+  int chunk = doc_size - offset;
+  if (chunk > length) chunk = length;
+  if (chunk > send.buf_size - 1) chunk = send.buf_size - 1;
+
+  send.start_packet();
+  send.put(offset + chunk < doc_size ? 'm' : 'l');
+  for (int i = 0; i < chunk; i++) {
+    send.put(doc[offset + i]);
+  }
+  send.end_packet();
+}
+
+//------------------------------------------------------------------------------
+// General set packets
+
+void GDBServer::handle_Q() {
+  if (recv.match_prefix("QStartNoAckMode")) {
+    // GDB acks our OK, after that neither side sends acks. We switch when
+    // that last ack arrives.
+    no_ack_pending = true;
+    send.set_packet("OK");
+  }
+  else {
+    recv.cursor2 = recv.buf + recv.size;
+    send.set_packet("");
+  }
+  next_state = SEND_PREFIX;
+}
+
 //------------------------------------------------------------------------------
 // Restart
 
@@ -440,22 +730,102 @@ void GDBServer::handle_R() {
 void GDBServer::handle_s() {
   recv.take('s');
   soft->step();
-  send.set_packet("T05");
+  put_stop_reply();
   next_state = SEND_PREFIX;
 }
 
+//------------------------------------------------------------------------------
+// Resume with actions - "vCont;<action>[:<thread>][;<action>...]"
+// We only have one thread, so the first action is the one that applies to it.
+// Signals in C/S are ignored, like in c/s.
+
+void GDBServer::handle_vCont() {
+  char action = recv.take_char();
+
+  switch(action) {
+    case 'C':
+    case 'S':
+      recv.take_hex();
+      break;
+    case 'r':
+      step_start = recv.take_hex();
+      recv.take(',');
+      step_end = recv.take_hex();
+      break;
+  }
+
+  // Skip the thread id and any further actions.
+  recv.cursor2 = recv.buf + recv.size;
+
+  if (recv.error) {
+    send.set_packet("E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
+
+  switch(action) {
+    case 'c':
+    case 'C':
+      resume_target();
+      break;
+
+    case 's':
+    case 'S':
+      soft->step();
+      put_stop_reply();
+      next_state = SEND_PREFIX;
+      break;
+
+    case 't':
+      soft->halt();
+      put_stop_reply();
+      next_state = SEND_PREFIX;
+      break;
+
+    case 'r':
+      // Range stepping happens in update() so that we keep servicing USB and
+      // can be interrupted.
+      soft->step();
+      next_state = STEPPING;
+      break;
+
+    default:
+      send.set_packet("");
+      next_state = SEND_PREFIX;
+      break;
+  }
+}
+
+//----------
+// Step through [step_start, step_end) on our side and only report a stop
+// once we leave the range or land on a breakpoint.
+
+void GDBServer::step_range() {
+  for (int i = 0; i < range_step_batch; i++) {
+    uint32_t dpc = rvd->get_dpc();
+    if (dpc < step_start || dpc >= step_end || (soft->has_breakpoint(dpc) && should_stop(dpc))) {
+      put_stop_reply();
+      state = SEND_PREFIX;
+      next_state = SEND_PREFIX;
+      return;
+    }
+    soft->step();
+  }
+}
+
 //------------------------------------------------------------------------------
 
 void GDBServer::handle_v() {
-#if 0
-  if (recv.match("vCont?")) {
-    // FIXME what does this do?
-    send.set_packet("");
+  if (recv.match_prefix("vCont?")) {
+    send.set_packet("vCont;c;C;s;S;t;r");
   }
-  else
-#endif
-  if (recv.match_prefix("vFlash")) {
+  else if (recv.match_prefix("vCont;")) {
+    handle_vCont();
+    return;
+  }
+  else if (recv.match_prefix("vFlash")) {
     if (recv.match_prefix("Write")) {
+      flash->begin_session();
       recv.take(':');
       int addr = recv.take_hex();
       recv.take(":");
@@ -466,6 +836,8 @@ void GDBServer::handle_v() {
     }
     else if (recv.match_prefix("Done")) {
       flush_flash_cache();
+      finish_flash_erase();
+      flash->end_session();
       send.set_packet("OK");
     }
     else if (recv.match_prefix("Erase")) {
@@ -478,6 +850,7 @@ void GDBServer::handle_v() {
         send.set_packet("E00");
       }
       else {
+        flash->begin_session();
         flash_erase(addr, size);
         send.set_packet("OK");
       }
@@ -511,6 +884,8 @@ void GDBServer::handle_z0() {
 
   //LOG("GDBServer::handle_z0 0x%08x 0x%08x\n", addr, kind);
   soft->clear_breakpoint(addr, kind);
+  clear_conditions(addr);
+  trace->on_user_break(addr, false);
 
   send.set_packet("OK");
   next_state = SEND_PREFIX;
@@ -523,12 +898,31 @@ void GDBServer::handle_Z0() {
   uint32_t kind = recv.take_hex();
 
   //LOG("GDBServer::handle_Z0 0x%08x 0x%08x\n", addr, kind);
-  soft->set_breakpoint(addr, kind);
+  if (!take_conditions(addr)) {
+    send.set_packet("E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
 
-  send.set_packet("OK");
+  send.set_packet(set_user_break(addr, kind) ? "OK" : "E01");
   next_state = SEND_PREFIX;
 }
 
+//----------
+// GDB's breakpoint goes in after its conditions. One already at 'addr' is a
+// tracepoint we now share, which is fine. Any other failure undoes the
+// conditions and hands the address back to the tracepoint.
+
+bool GDBServer::set_user_break(uint32_t addr, int kind) {
+  bool shared = soft->has_breakpoint(addr);
+  trace->on_user_break(addr, true);
+  if (shared || soft->set_breakpoint(addr, kind) != -1) return true;
+
+  clear_conditions(addr);
+  trace->on_user_break(addr, false);
+  return false;
+}
+
 //------------------------------------------------------------------------------
 // FIXME one of these was software and one was hardware. do we care if both are implemented?
 
@@ -540,6 +934,8 @@ void GDBServer::handle_z1() {
 
   //LOG("GDBServer::handle_z1 0x%08x 0x%08x\n", addr, kind);
   soft->clear_breakpoint(addr, kind);
+  clear_conditions(addr);
+  trace->on_user_break(addr, false);
 
   send.set_packet("OK");
   next_state = SEND_PREFIX;
@@ -552,73 +948,573 @@ void GDBServer::handle_Z1() {
   uint32_t kind = recv.take_hex();
 
   //LOG("GDBServer::handle_Z1 0x%08x 0x%08x\n", addr, kind);
-  soft->set_breakpoint(addr, kind);
+  if (!take_conditions(addr)) {
+    send.set_packet("E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
 
-  send.set_packet("OK");
+  send.set_packet(set_user_break(addr, kind) ? "OK" : "E01");
   next_state = SEND_PREFIX;
 }
 
 //------------------------------------------------------------------------------
+// Conditional breakpoints - Z0/Z1 can carry ";X<len>,<bytecode>" agent
+// expressions after the kind. We evaluate them here when the breakpoint hits
+// and only report a stop if one of them is true, which saves GDB a round trip
+// (and us a halt/resume cycle) for every false hit. GDB always sends the full
+// set of conditions, so they replace whatever we had for that address.
+
+bool GDBServer::take_conditions(uint32_t addr) {
+  clear_conditions(addr);
+
+  while (recv.match(';')) {
+    // Breakpoint commands aren't advertised, ignore them if they show up.
+    if (recv.match_prefix("cmds:")) break;
+
+    recv.take('X');
+    int len = recv.take_hex();
+    recv.take(',');
+
+    if (recv.error || len <= 0 || len > cond_code_max || cond_count == cond_max) {
+      LOG_R("GDBServer::take_conditions - Can't store condition for 0x%08x\n", addr);
+      clear_conditions(addr);
+      return false;
+    }
 
-void GDBServer::flash_erase(int addr, int size) {
-  auto page_size = flash->get_page_size();
-  auto sector_size = flash->get_sector_size();
-  auto flash_base = flash->get_flash_base();
-  auto flash_size = flash->get_flash_size();
-
-  // Erases must be page-aligned
-  if ((addr % page_size) || (size % page_size)) {
-    LOG_R("\nBad vFlashErase - addr %x size %x\n", addr, size);
-    send.set_packet("E00");
-    return;
-  }
+    Cond& c = conds[cond_count];
+    c.addr = addr;
+    c.len = len;
+    for (int i = 0; i < len; i++) c.code[i] = recv.take_hex(2);
 
-  while (size) {
-    if (addr == flash->get_flash_base() && size == flash_size) {
-      //LOG("erase chip 0x%08x\n", addr);
-      flash->wipe_chip();
-      send.set_packet("OK");
-      addr += size;
-      size -= size;
-    }
-    else if (((addr % sector_size) == 0) && (size >= sector_size)) {
-      //LOG("erase sector 0x%08x\n", addr);
-      flash->wipe_sector(addr);
-      addr += sector_size;
-      size -= sector_size;
-    }
-    else if (((addr % page_size) == 0) && (size >= page_size)) {
-      //LOG("erase page 0x%08x\n", addr);
-      flash->wipe_page(addr);
-      addr += page_size;
-      size -= page_size;
-    }
-    else {
-      CHECK(false, "Should not get here?");
+    if (recv.error) {
+      clear_conditions(addr);
+      return false;
     }
+    cond_count++;
   }
 
-  send.set_packet("OK");
+  return true;
 }
 
-//------------------------------------------------------------------------------
-
-void GDBServer::put_flash_cache(int addr, uint8_t data) {
-  int page_size = flash->get_page_size();
-  int page_offset = addr % page_size;
-  int page_base   = addr - page_offset;
+//----------
 
-  if (this->page_bitmap && page_base != this->page_base) {
-    flush_flash_cache();
+void GDBServer::clear_conditions(uint32_t addr) {
+  int j = 0;
+  for (int i = 0; i < cond_count; i++) {
+    if (conds[i].addr != addr) conds[j++] = conds[i];
   }
-  this->page_base = page_base;
+  cond_count = j;
+}
 
-  if (this->page_bitmap & (1 << page_offset)) {
+//----------
+// True if the target should stop at 'addr' - there's no condition there, or
+// one of them evaluated to nonzero. Expressions we can't evaluate stop the
+// target too, same as GDB would.
+
+bool GDBServer::condition_true(uint32_t addr) {
+  bool any = false;
+  for (int i = 0; i < cond_count; i++) {
+    if (conds[i].addr != addr) continue;
+    any = true;
+    int64_t result = 0;
+    if (!agent->eval(conds[i].code, conds[i].len, result) || result) return true;
+  }
+  return !any;
+}
+
+//----------
+// Decides whether a breakpoint hit at 'addr' gets reported to GDB.
+// Tracepoints collect their frame here and only stop the target if GDB has a
+// breakpoint of its own at the same place.
+
+bool GDBServer::should_stop(uint32_t addr) {
+  if (trace->on_hit(addr)) return false;
+  return condition_true(addr);
+}
+
+//------------------------------------------------------------------------------
+// Tracepoints - "QTinit", "QTDP", "QTStart", "QTStop", "qTStatus", "QTFrame",
+// "qTBuffer" and friends. Definitions and collection live in Trace, this just
+// speaks the protocol.
+
+void GDBServer::handle_trace() {
+  if (recv.match_prefix("QTinit")) {
+    trace->init();
+    send.set_packet("OK");
+  }
+  else if (recv.match_prefix("QTDP:")) {
+    handle_QTDP();
+  }
+  else if (recv.match_prefix("QTStart")) {
+    send.set_packet(trace->start() ? "OK" : "E01");
+  }
+  else if (recv.match_prefix("QTStop")) {
+    if (trace->is_running()) trace->stop();
+    send.set_packet("OK");
+  }
+  else if (recv.match_prefix("QTFrame:")) {
+    handle_QTFrame();
+  }
+  else if (recv.match_prefix("qTStatus")) {
+    char buf[128];
+    int size = 0;
+    if (trace->is_running()) {
+      size = snprintf(buf, sizeof(buf), "T1");
+    }
+    else {
+      // tstop and terror carry a (here empty) text field before the number
+      const char* reason = trace->get_stop_reason();
+      bool text = !strcmp(reason, "tstop") || !strcmp(reason, "terror");
+      size = snprintf(buf, sizeof(buf), "T0;%s:%s%x", reason, text ? ":" : "", trace->get_stop_tp());
+    }
+    snprintf(buf + size, sizeof(buf) - size, ";tframes:%x;tcreated:%x;tfree:%x;tsize:%x;circular:0;disconn:0",
+      trace->get_frame_count(), trace->get_created(),
+      trace->get_buffer_size() - trace->get_buffer_used(), trace->get_buffer_size());
+    send.set_packet(buf);
+  }
+  else if (recv.match_prefix("qTBuffer:")) {
+    int offset = recv.take_hex();
+    recv.take(',');
+    int len = recv.take_hex();
+
+    uint8_t buf[256];
+    int max = (send.buf_size - 1) / 2;
+    if (len > max) len = max;
+    if (len > (int)sizeof(buf)) len = sizeof(buf);
+
+    if (recv.error || len <= 0) {
+      send.set_packet("E01");
+    }
+    else {
+      len = trace->read_buffer(offset, buf, len);
+      if (len) {
+        send.start_packet();
+        send.put_hex_blob(buf, len);
+        send.end_packet();
+      }
+      else {
+        send.set_packet("l");
+      }
+    }
+  }
+  else if (recv.match_prefix("qTP:")) {
+    int num = recv.take_hex();
+    recv.take(':');
+    uint32_t addr = recv.take_hex();
+    auto tp = trace->get_tracepoint(num, addr);
+    if (tp) {
+      char buf[24];
+      snprintf(buf, sizeof(buf), "V%x:0", tp->hits);
+      send.set_packet(buf);
+    }
+    else {
+      send.set_packet("E01");
+    }
+  }
+  // We don't upload existing tracepoints or state variables to GDB
+  else if (recv.match_prefix("qTfP") || recv.match_prefix("qTsP") ||
+           recv.match_prefix("qTfV") || recv.match_prefix("qTsV")) {
+    send.set_packet("l");
+  }
+  // Settings that don't change anything for us
+  else if (recv.match_prefix("QTro") || recv.match_prefix("QTDisconnected:") ||
+           recv.match_prefix("QTBuffer:circular:0")) {
+    recv.cursor2 = recv.buf + recv.size;
+    send.set_packet("OK");
+  }
+  else {
+    recv.cursor2 = recv.buf + recv.size;
+    send.set_packet("");
+  }
+  next_state = SEND_PREFIX;
+}
+
+//----------
+// "QTDP:<n>:<addr>:<E|D>:<step>:<pass>[:X<len>,<cond>][-]" defines a
+// tracepoint, then "QTDP:-<n>:<addr>:<action>[-]" adds one action at a time -
+// "R<mask>" registers, "M<reg>,<offset>,<len>" memory, "X<len>,<expr>" an
+// expression. While-stepping ("S") actions aren't supported and are dropped.
+
+void GDBServer::handle_QTDP() {
+  bool more = recv.match('-');
+  int num = recv.take_hex();
+  recv.take(':');
+  uint32_t addr = recv.take_hex();
+  recv.take(':');
+
+  Trace::Tracepoint* tp = nullptr;
+  if (!more) {
+    tp = trace->add_tracepoint(num, addr);
+    if (tp) {
+      tp->enabled = recv.take_char() == 'E';
+      recv.take(':');
+      int step = recv.take_hex();
+      recv.take(':');
+      tp->pass = recv.take_hex();
+      if (step) LOG_R("GDBServer::handle_QTDP - while-stepping not supported\n");
+
+      while (recv.match(':')) {
+        if (recv.match('X')) {
+          tp->cond_len = take_code(tp->cond);
+        }
+        else {
+          // Fast tracepoint length etc, not supported
+          while (recv.peek_char() && recv.peek_char() != ':' && recv.peek_char() != '-') recv.take_char();
+        }
+      }
+    }
+  }
+  else {
+    tp = trace->get_tracepoint(num, addr);
+    while (tp && !recv.error && recv.peek_char() && recv.peek_char() != '-') {
+      char c = recv.take_char();
+      if (c == 'S') {
+        recv.cursor2 = recv.buf + recv.size;
+        break;
+      }
+      else if (c == 'R') {
+        while (from_hex(recv.peek_char()) != -1) recv.take_char();
+        tp->collect_regs = true;
+      }
+      else if (c == 'M' && tp->mem_count < Trace::mem_max) {
+        int i = tp->mem_count++;
+        tp->mem_reg[i] = recv.take_hex();
+        recv.take(',');
+        tp->mem_offset[i] = recv.take_hex();
+        recv.take(',');
+        tp->mem_len[i] = recv.take_hex();
+      }
+      else if (c == 'X' && tp->expr_count < Trace::expr_max) {
+        int i = tp->expr_count++;
+        tp->expr_len[i] = take_code(tp->expr[i]);
+      }
+      else {
+        tp = nullptr;
+      }
+    }
+  }
+  recv.match('-');
+
+  if (!tp || recv.error) {
+    LOG_R("GDBServer::handle_QTDP - Can't define tracepoint %d at 0x%08x\n", num, addr);
+    recv.cursor2 = recv.buf + recv.size;
+    recv.error = false;
+    send.set_packet("E01");
+    return;
+  }
+  send.set_packet("OK");
+}
+
+//----------
+// "<len>,<bytecode>" into 'code', returns the length or sets recv.error.
+
+int GDBServer::take_code(uint8_t* code) {
+  int len = recv.take_hex();
+  recv.take(',');
+  if (len <= 0 || len > Trace::code_max) {
+    recv.error = true;
+    return 0;
+  }
+  for (int i = 0; i < len; i++) code[i] = recv.take_hex(2);
+  return len;
+}
+
+//----------
+// "QTFrame:<n>", "QTFrame:pc:<addr>", "QTFrame:tdp:<t>",
+// "QTFrame:range:<start>:<end>", "QTFrame:outside:<start>:<end>"
+
+void GDBServer::handle_QTFrame() {
+  int n = -1;
+  if (recv.match_prefix("pc:")) {
+    n = trace->find_frame_pc(recv.take_hex());
+  }
+  else if (recv.match_prefix("tdp:")) {
+    n = trace->find_frame_tp(recv.take_hex());
+  }
+  else if (recv.match_prefix("range:")) {
+    uint32_t start = recv.take_hex();
+    recv.take(':');
+    uint32_t end = recv.take_hex();
+    n = trace->find_frame_range(start, end, true);
+  }
+  else if (recv.match_prefix("outside:")) {
+    uint32_t start = recv.take_hex();
+    recv.take(':');
+    uint32_t end = recv.take_hex();
+    n = trace->find_frame_range(start, end, false);
+  }
+  else {
+    uint32_t want = recv.take_hex();
+    if (want == 0xFFFFFFFF) {
+      // Back to the live target
+      trace->select_frame(-1);
+      send.set_packet("OK");
+      return;
+    }
+    n = trace->select_frame(want);
+  }
+
+  if (n == -1) {
+    send.set_packet("F-1");
+  }
+  else {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "F%xT%x", n, trace->get_frame_tp());
+    send.set_packet(buf);
+  }
+}
+
+//----------
+// Registers of the selected trace frame - all of them for 'g' (reg == -1),
+// one for 'p'. Registers the frame didn't collect come back as 'x's, which
+// GDB shows as unavailable.
+
+void GDBServer::put_frame_regs(int reg) {
+  uint32_t regs[33];
+  bool valid = trace->get_frame_regs(regs);
+  int count = rvd->get_gpr_count() + 1;
+
+  int first = 0;
+  if (reg != -1) {
+    first = reg == reg_pc ? count - 1 : reg;
+    if (first >= count - 1 && reg != reg_pc) {
+      send.set_packet("E01");
+      return;
+    }
+    count = first + 1;
+  }
+
+  send.start_packet();
+  for (int i = first; i < count; i++) {
+    if (valid) send.put_hex_u32(regs[i]);
+    else       send.put_str("xxxxxxxx");
+  }
+  send.end_packet();
+}
+
+//----------
+// Memory of the selected trace frame. Flash is read-only, so anything there
+// the frame doesn't have can still come from the target.
+
+void GDBServer::put_frame_mem(uint32_t src, int len, bool binary) {
+  uint8_t buf[256];
+  if (len > (int)sizeof(buf)) len = sizeof(buf);
+
+  int got = trace->read_frame_mem(src, buf, len);
+  if (!got) {
+    uint32_t offset = (src & 0xFF000000) == 0x08000000 ? src & 0x00FFFFFF : src;
+    if (offset - flash->get_flash_base() < (uint32_t)flash->get_flash_size()) {
+      read_mem(src, buf, len);
+      got = len;
+    }
+  }
+
+  if (!got && len) {
+    send.set_packet("E01");
+  }
+  else {
+    send.start_packet();
+    if (binary) {
+      send.put('b');
+      send.put_blob(buf, got);
+    }
+    else {
+      send.put_hex_blob(buf, got);
+    }
+    send.end_packet();
+  }
+  next_state = SEND_PREFIX;
+}
+
+//------------------------------------------------------------------------------
+// Watchpoints - "Z2,<addr>,<len>" write, "Z3" read, "Z4" access, "z*" clear.
+//
+// Data triggers are used when the chip has them. Otherwise write watchpoints
+// fall back to sampling - while the target runs we halt it every
+// watch_interval, compare the watched bytes against the last copy, and report
+// a stop if they changed. Read and access watchpoints need triggers.
+
+void GDBServer::handle_watch() {
+  bool set = recv.take_char() == 'Z';
+  int type = recv.take_char() - '0';
+  recv.take(',');
+  uint32_t addr = recv.take_hex();
+  recv.take(',');
+  int len = recv.take_hex();
+
+  if (recv.error) {
+    send.set_packet("E01");
+    next_state = SEND_PREFIX;
+    return;
+  }
+
+  uint32_t match = type == 2 ? CSR_MCONTROL_STORE
+                 : type == 3 ? CSR_MCONTROL_LOAD
+                 : CSR_MCONTROL_LOAD | CSR_MCONTROL_STORE;
+
+  if (!set) {
+    if (soft->clear_trigger(addr, match, len) == -1) remove_watch(addr, len);
+    send.set_packet("OK");
+  }
+  else if (soft->set_trigger(addr, match, len) != -1) {
+    send.set_packet("OK");
+  }
+  else if (type != 2) {
+    // No trigger that covers the range, and we can't sample for reads. Tell
+    // GDB we don't do these.
+    send.set_packet("");
+  }
+  else {
+    send.set_packet(add_watch(addr, len) ? "OK" : "E01");
+  }
+  next_state = SEND_PREFIX;
+}
+
+//----------
+
+bool GDBServer::add_watch(uint32_t addr, int len) {
+  if (watch_count == watch_max || len <= 0 || len > watch_len_max) {
+    LOG_R("GDBServer::add_watch - Can't watch 0x%08x %d\n", addr, len);
+    return false;
+  }
+
+  Watch& w = watches[watch_count++];
+  w.addr = addr;
+  w.len = len;
+  read_mem(addr, w.last, len);
+  return true;
+}
+
+void GDBServer::remove_watch(uint32_t addr, int len) {
+  for (int i = 0; i < watch_count; i++) {
+    if (watches[i].addr == addr && watches[i].len == len) {
+      watches[i] = watches[--watch_count];
+      return;
+    }
+  }
+}
+
+//----------
+// Memory can change while we're halted (GDB writes, steps), so the reference
+// copies are refreshed on every resume.
+
+void GDBServer::refresh_watches() {
+  for (int i = 0; i < watch_count; i++) {
+    read_mem(watches[i].addr, watches[i].last, watches[i].len);
+  }
+}
+
+//----------
+// Briefly halt the running target and check the sampled watchpoints. Flash
+// stays patched while we look, the hart only leaves debug mode again if
+// nothing changed.
+
+void GDBServer::sample_watches() {
+  if (rvd->get_dmstatus().ALLHALTED) return; // Breakpoint, the poll handles it
+
+  rvd->halt();
+
+  for (int i = 0; i < watch_count; i++) {
+    uint8_t now[watch_len_max];
+    read_mem(watches[i].addr, now, watches[i].len);
+    if (memcmp(now, watches[i].last, watches[i].len) != 0) {
+      memcpy(watches[i].last, now, watches[i].len);
+      soft->halt();
+      put_stop_reply("watch", watches[i].addr);
+      state = SEND_PREFIX;
+      next_state = SEND_PREFIX;
+      return;
+    }
+  }
+
+  rvd->resume();
+}
+
+//------------------------------------------------------------------------------
+
+void GDBServer::flash_erase(int addr, int size) {
+  auto page_size = flash->get_page_size();
+  auto sector_size = flash->get_sector_size();
+  auto flash_base = flash->get_flash_base();
+  auto flash_size = flash->get_flash_size();
+
+  // Erases must be page-aligned
+  if ((addr % page_size) || (size % page_size)) {
+    LOG_R("\nBad vFlashErase - addr %x size %x\n", addr, size);
+    send.set_packet("E00");
+    return;
+  }
+
+  // In differential mode we just remember which pages GDB wants erased. Pages
+  // that get rewritten are erased in flush_flash_cache() only if their
+  // contents changed, and the rest are handled by finish_flash_erase().
+  if (diff_flash) {
+    if (addr < flash_base || addr + size > flash_base + flash_size) {
+      LOG_R("\nBad vFlashErase - addr %x size %x\n", addr, size);
+      send.set_packet("E00");
+      return;
+    }
+    for (int page = addr / page_size; page < (addr + size) / page_size; page++) {
+      erase_map[page] = 1;
+    }
+    send.set_packet("OK");
+    return;
+  }
+
+  while (size) {
+    if (addr == flash->get_flash_base() && size == flash_size) {
+      //LOG("erase chip 0x%08x\n", addr);
+      flash->wipe_chip();
+      send.set_packet("OK");
+      addr += size;
+      size -= size;
+    }
+    else if (((addr % sector_size) == 0) && (size >= sector_size)) {
+      //LOG("erase sector 0x%08x\n", addr);
+      flash->wipe_sector(addr);
+      addr += sector_size;
+      size -= sector_size;
+    }
+    else if (((addr % page_size) == 0) && (size >= page_size)) {
+      //LOG("erase page 0x%08x\n", addr);
+      flash->wipe_page(addr);
+      addr += page_size;
+      size -= page_size;
+    }
+    else {
+      CHECK(false, "Should not get here?");
+    }
+  }
+
+  send.set_packet("OK");
+}
+
+//------------------------------------------------------------------------------
+
+void GDBServer::put_flash_cache(int addr, uint8_t data) {
+  int page_size = flash->get_page_size();
+  int page_offset = addr % page_size;
+  int page_base   = addr - page_offset;
+
+  if (this->page_fill && page_base != this->page_base) {
+    flush_flash_cache();
+  }
+  this->page_base = page_base;
+
+  if (this->page_mask[page_offset]) {
     LOG_R("\nByte in flash page written multiple times\n");
   }
   else {
     this->page_cache[page_offset] = data;
-    this->page_bitmap |= (1ull << page_offset);
+    this->page_mask[page_offset] = 1;
+    this->page_fill++;
+  }
+
+  // Write full pages as soon as they're complete, we don't need to wait for
+  // the rest of the packet.
+  if (this->page_fill == page_size) {
+    flush_flash_cache();
   }
 }
 
@@ -627,25 +1523,100 @@ void GDBServer::put_flash_cache(int addr, uint8_t data) {
 void GDBServer::flush_flash_cache() {
   if (page_base == -1) return;
 
-  if (!page_bitmap) {
+  if (!page_fill) {
     // empty page cache, nothing to do - why did this happen?
     LOG_R("empty page write at    0x%08x\n", this->page_base);
   }
   else  {
-    if (page_bitmap == 0xFFFFFFFFFFFFFFFF) {
+    if (page_fill == flash->get_page_size()) {
       // full page write
       //LOG("full page write at    0x%08x\n", this->page_base);
     }
     else {
-      //LOG("partial page write at 0x%08x, mask 0x%016llx\n", this->page_base, this->page_bitmap);
+      //LOG("partial page write at 0x%08x, %d bytes\n", this->page_base, this->page_fill);
+    }
+
+    if (!diff_flash) {
+      flash->write_flash(page_base, page_cache, flash->get_page_size());
     }
+    else {
+      // The erase would also wipe bytes we weren't given, which may be from an
+      // earlier flush of this page. Keep them, unless GDB erased the page.
+      int page_size = flash->get_page_size();
+      const uint8_t* contents = read_flash_page(page_base);
+      if (!erase_map[page_base / page_size]) {
+        for (int i = 0; i < page_size; i++) {
+          if (!page_mask[i]) page_cache[i] = contents[i];
+        }
+      }
 
-    flash->write_flash(page_base, page_cache, flash->get_page_size());
+      if (memcmp(contents, page_cache, page_size) == 0) {
+        // Chip already has this page, skip both the erase and the write.
+        //LOG("unchanged page at    0x%08x\n", this->page_base);
+      }
+      else {
+        flash->erase_and_program(page_base, page_cache, page_size);
+      }
+    }
+    erase_map[page_base / flash->get_page_size()] = 0;
   }
 
-  this->page_bitmap = 0;
+  discard_flash_cache();
+}
+
+//------------------------------------------------------------------------------
+
+void GDBServer::discard_flash_cache() {
+  this->page_fill = 0;
   this->page_base = -1;
-  for (int i = 0; i < 64; i++) this->page_cache[i] = 0xFF;
+  for (int i = 0; i < flash->get_page_size(); i++) {
+    this->page_cache[i] = 0xFF;
+    this->page_mask[i] = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Reading a page back over SWIO is several times faster than erasing and
+// reprogramming it, so we always check before touching the flash. Pages
+// covered by SoftBreak's mirror don't need reading at all.
+
+const uint8_t* GDBServer::read_flash_page(int addr) {
+  int page_size = flash->get_page_size();
+  const uint8_t* clean = soft->get_clean_flash(addr, page_size);
+  if (clean) return clean;
+
+  rvd->get_block_aligned(flash->get_flash_base() + addr, page_readback, page_size);
+  return page_readback;
+}
+
+//------------------------------------------------------------------------------
+// Erase any pages GDB asked us to erase but never wrote to. Pages that are
+// already blank are skipped.
+
+void GDBServer::finish_flash_erase() {
+  int page_size = flash->get_page_size();
+  int page_count = flash->get_page_count();
+
+  for (int page = 0; page < page_count; page++) {
+    if (!erase_map[page]) continue;
+    erase_map[page] = 0;
+
+    int page_base = page * page_size;
+    const uint8_t* contents = read_flash_page(page_base);
+
+    bool blank = true;
+    for (int i = 0; i < page_size; i++) {
+      if (contents[i] != 0xFF) {
+        blank = false;
+        break;
+      }
+    }
+
+    if (!blank) {
+      //LOG("erase page 0x%08x\n", page_base);
+      flash->wipe_page(page_base);
+    }
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -690,19 +1661,58 @@ void GDBServer::handle_packet() {
   }
 }
 
+//------------------------------------------------------------------------------
+// Stop reply with pc, sp and ra expedited, which covers most of what GDB
+// needs to show the stop location and unwind the first frame without reading
+// the whole register file.
+
+void GDBServer::put_stop_reply(const char* reason, uint32_t addr) {
+  send.start_packet();
+  send.put_str("T05");
+  if (reason) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%s:%08x;", reason, addr);
+    send.put_str(buf);
+  }
+  send.put_str("20:");
+  send.put_hex_u32(rvd->get_dpc());
+  send.put_str(";02:");
+  send.put_hex_u32(rvd->get_user_gpr(2));
+  send.put_str(";01:");
+  send.put_hex_u32(rvd->get_user_gpr(1));
+  send.put(';');
+  send.end_packet();
+}
+
 //------------------------------------------------------------------------------
 
 void GDBServer::on_hit_breakpoint() {
   //LOG("Breaking\n");
-  send.set_packet("T05");
+  int slot = soft->get_trigger_count() ? soft->find_hit_trigger() : -1;
+  if (slot == -1 && !should_stop(rvd->get_dpc())) {
+    // Condition false or tracepoint collected, keep going without bothering GDB.
+    continue_target();
+    state = next_state;
+    return;
+  }
+
+  if (slot != -1) {
+    uint32_t match = soft->get_trigger_match(slot);
+    const char* reason = match == CSR_MCONTROL_STORE ? "watch"
+                       : match == CSR_MCONTROL_LOAD  ? "rwatch"
+                       : "awatch";
+    put_stop_reply(reason, soft->get_trigger_addr(slot));
+  }
+  else {
+    put_stop_reply();
+  }
   state = SEND_PREFIX;
+  next_state = SEND_PREFIX;
 }
 
 //------------------------------------------------------------------------------
 
-void GDBServer::update(bool connected, bool byte_ie, char byte_in, bool& byte_oe, char& byte_out) {
-  byte_out = 0;
-  byte_oe = 0;
+int GDBServer::update(bool connected, const char* in, int in_size) {
 
   //----------------------------------------
   // Connection/disconnection
@@ -710,20 +1720,340 @@ void GDBServer::update(bool connected, bool byte_ie, char byte_in, bool& byte_oe
   if (state == DISCONNECTED && connected) {
     LOG("GDB connected\n");
     soft->halt();
+    soft->snapshot();
+    soft->init_triggers();
     state = IDLE;
     next_state = IDLE;
   }
   else if (state != DISCONNECTED && !connected) {
     LOG("GDB disconnected\n");
+    flash->end_session();
+    trace->init();
     soft->clear_all_breakpoints();
+    watch_count = 0;
+    cond_count = 0;
     soft->resume();
+    ack_out = 0;
+    no_ack = false;
+    no_ack_pending = false;
     state = DISCONNECTED;
     next_state = DISCONNECTED;
   }
 
   //----------------------------------------
-  // Main state machine
+  // Check for breakpoint hits while the target is running
+
+  // Breakpoints usually hit soon after a resume, so we poll fast at first and
+  // back off while the target keeps running. Input from GDB starts the fast
+  // polling over again.
+
+  if (state == RUNNING) {
+    if (in_size) poll_interval = poll_min;
+
+    uint32_t now = time_us_32();
+    if ((now - last_halt_check) > poll_interval) {
+      last_halt_check = now;
+      if (rvd->get_dmstatus().ALLHALTED) {
+        //printf("\nCore halted due to breakpoint @ 0x%08x\n", sl.get_csr(CSR_DPC));
+        soft->halt();
+        on_hit_breakpoint();
+      }
+      else {
+        poll_interval = poll_interval * 2 > poll_max ? poll_max : poll_interval * 2;
+      }
+    }
+  }
+
+  if (state == RUNNING && watch_count) {
+    uint32_t now = time_us_32();
+    if ((now - last_watch_check) > watch_interval) {
+      last_watch_check = now;
+      sample_watches();
+    }
+  }
+
+  if (state == STEPPING) {
+    step_range();
+  }
+
+  //----------------------------------------
+  // Feed the parser until we run out of input or have a reply to send. Input
+  // we don't consume is left for the next call.
+
+  int used = 0;
+  while (used < in_size && !sending()) {
+    on_byte(in[used++]);
+  }
+  return used;
+}
+
+//------------------------------------------------------------------------------
+// Run-length encoding - "c*n" stands for c followed by n-29 more copies of c.
+// The count character must be printable and can't be '#' or '$', which rules
+// out 6 and 7 repeats. Runs shorter than 3 repeats don't save anything.
+
+int GDBServer::count_run(char c) {
+  const int run_max = 126 - 29;
+
+  int avail = send.size - (send.cursor2 - send.buf);
+  if (avail > run_max) avail = run_max;
+
+  int n = 0;
+  while (n < avail && send.cursor2[n] == c) n++;
+
+  if (n < 3) return 0;
+  if (n == 6 || n == 7) return 5;
+  return n;
+}
+
+//------------------------------------------------------------------------------
+// Encodes as much of the pending output as fits in 'out', so the caller can
+// push it to the host with a single write & flush.
+
+int GDBServer::get_output(char* out, int max) {
+  int size = 0;
+
+  if (ack_out && size < max) {
+    out[size++] = ack_out;
+    ack_out = 0;
+  }
+
+  while (size < max) {
+    switch(state) {
+      case SEND_PREFIX: {
+#ifdef DEBUG_REMOTE
+        printf("<<   %s\n", send.buf);
+#endif
+        out[size++] = '$';
+        checksum = 0;
+        next_state = send.size ? SEND_PACKET : SEND_SUFFIX1;
+        send.cursor2 = send.buf;
+        break;
+      }
+
+      case SEND_PACKET: {
+        char c = *send.cursor2;
+        if (c == '#' || c == '$' || c == '}' || c == '*') {
+          checksum += '}';
+          out[size++] = '}';
+          next_state = SEND_PACKET_ESCAPE;
+        }
+        else {
+          checksum += c;
+          out[size++] = c;
+          send.cursor2++;
+          run_count = count_run(c);
+          if (run_count) {
+            next_state = SEND_RUN_STAR;
+          }
+          else if ((send.cursor2 - send.buf) == send.size) {
+            next_state = SEND_SUFFIX1;
+          }
+        }
+        break;
+      }
+
+      case SEND_PACKET_ESCAPE: {
+        char c = *send.cursor2;
+        checksum += c ^ 0x20;
+        out[size++] = c ^ 0x20;
+        send.cursor2++;
+        next_state = ((send.cursor2 - send.buf) == send.size) ? SEND_SUFFIX1 : SEND_PACKET;
+        break;
+      }
+
+      case SEND_RUN_STAR:
+        checksum += '*';
+        out[size++] = '*';
+        next_state = SEND_RUN_COUNT;
+        break;
+
+      case SEND_RUN_COUNT: {
+        char n = char(run_count + 29);
+        checksum += n;
+        out[size++] = n;
+        send.cursor2 += run_count;
+        next_state = ((send.cursor2 - send.buf) == send.size) ? SEND_SUFFIX1 : SEND_PACKET;
+        break;
+      }
+
+      case SEND_SUFFIX1:
+        out[size++] = '#';
+        next_state = SEND_SUFFIX2;
+        break;
+
+      case SEND_SUFFIX2:
+        out[size++] = to_hex((checksum >> 4) & 0xF);
+        next_state = SEND_SUFFIX3;
+        break;
+
+      case SEND_SUFFIX3:
+        out[size++] = to_hex((checksum >> 0) & 0xF);
+        next_state = no_ack ? IDLE : RECV_ACK;
+        break;
+
+      default:
+        // Nothing (more) to send
+        return size;
+    }
+
+    state = next_state;
+  }
+
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Large writes (vFlashWrite and M) are consumed as they arrive instead of
+// being buffered in recv - full flash pages get programmed and memory gets
+// written while the rest of the packet is still coming in over USB. The
+// header stays in recv so the handler can still parse it and reply once the
+// checksum checks out.
+
+void GDBServer::put_payload(char c) {
+  if (stream_mode != STREAM_NONE) {
+    stream_byte(c);
+    return;
+  }
+
+  recv.put(c);
+  if (c == ':') start_stream();
+}
+
+//----------------------------------------
+
+void GDBServer::start_stream() {
+  char* end = recv.buf + recv.size - 1; // The ':' we just got
+  char* cursor = nullptr;
+  int addr = 0;
+  int len = 0;
+
+  if (cmp("vFlashWrite:", recv.buf) == 0) {
+    cursor = atox(recv.buf + 12, addr);
+    if (cursor == end) {
+      flash->begin_session();
+      stream_mode = STREAM_FLASH;
+    }
+  }
+  else if (recv.buf[0] == 'M' || recv.buf[0] == 'X') {
+    cursor = atox(recv.buf + 1, addr);
+    if (cursor && *cursor == ',') cursor = atox(cursor + 1, len);
+    if (cursor == end) {
+      stream_mode = recv.buf[0] == 'M' ? STREAM_MEM_HEX : STREAM_MEM_BIN;
+    }
+  }
+
+  stream_addr   = addr;
+  stream_count  = 0;
+  stream_nibble = -1;
+  stream_size   = 0;
+}
+
+//----------------------------------------
+
+void GDBServer::stream_byte(char c) {
+  switch(stream_mode) {
+    case STREAM_FLASH: {
+      put_flash_cache(stream_addr + stream_count, c);
+      stream_count++;
+      break;
+    }
+    case STREAM_MEM_HEX: {
+      int digit = from_hex(c);
+      if (digit == -1) {
+        stream_error = true;
+      }
+      else if (stream_nibble == -1) {
+        stream_nibble = digit;
+      }
+      else {
+        stream_mem((stream_nibble << 4) | digit);
+        stream_nibble = -1;
+      }
+      break;
+    }
+    case STREAM_MEM_BIN: {
+      stream_mem(c);
+      break;
+    }
+  }
+}
+
+//----------------------------------------
+// Memory writes are batched up so that aligned runs can use block writes.
+
+void GDBServer::stream_mem(uint8_t b) {
+  stream_buf[stream_size++] = b;
+  stream_count++;
+  if (((stream_addr + stream_size) % sizeof(stream_buf)) == 0) {
+    flush_stream();
+  }
+}
+
+void GDBServer::flush_stream() {
+  write_mem(stream_addr, stream_buf, stream_size);
+  stream_addr += stream_size;
+  stream_size = 0;
+}
+
+//------------------------------------------------------------------------------
+// Single halfword and word accesses keep their width so peripheral registers
+// can be read through x as well as m. Breakpoints that SoftBreak left in flash
+// get replaced with the original instructions.
+
+void GDBServer::read_mem(uint32_t src, uint8_t* dst, int len) {
+  uint32_t addr = src;
+  uint8_t* buf = dst;
+  int size = len;
+
+  if (len == 2 && (src & 1) == 0) {
+    uint16_t data = rvd->get_mem_u16(src);
+    memcpy(dst, &data, 2);
+    len = 0;
+  }
+
+  while (len) {
+    if ((src & 3) == 0 && len >= 4) {
+      int chunk = len & ~3;
+      rvd->get_block_aligned(src, dst, chunk);
+      src += chunk;
+      dst += chunk;
+      len -= chunk;
+    }
+    else {
+      *dst = rvd->get_mem_u8(src);
+      src += 1;
+      dst += 1;
+      len -= 1;
+    }
+  }
+
+  soft->overlay_clean(addr, buf, size);
+}
+
+//------------------------------------------------------------------------------
+
+void GDBServer::write_mem(uint32_t dst, uint8_t* src, int len) {
+  while (len) {
+    if ((dst & 3) == 0 && len >= 4) {
+      int chunk = len & ~3;
+      rvd->set_block_aligned(dst, src, chunk);
+      dst += chunk;
+      src += chunk;
+      len -= chunk;
+    }
+    else {
+      rvd->set_mem_u8(dst, *src);
+      dst += 1;
+      src += 1;
+      len -= 1;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
 
+void GDBServer::on_byte(char byte_in) {
   switch(state) {
     case DISCONNECTED: {
       break;
@@ -734,22 +2064,19 @@ void GDBServer::update(bool connected, bool byte_ie, char byte_in, bool& byte_oe
         // Got a break character from GDB while running.
         LOG("Breaking\n");
         soft->halt();
-        send.set_packet("T05");
+        put_stop_reply();
         next_state = SEND_PREFIX;
       }
-      else {
-        uint32_t now = time_us_32();
-        if ((now - last_halt_check) > breakpoint_check_interval) {
-          last_halt_check = now;
-          if (rvd->get_dmstatus().ALLHALTED) {
-            //printf("\nCore halted due to breakpoint @ 0x%08x\n", sl.get_csr(CSR_DPC));
-            soft->halt();
-            send.set_packet("T05");
-            next_state = SEND_PREFIX;
-          }
-        }
-      }
+      break;
+    }
 
+    case STEPPING: {
+      if (byte_in == '\x003') {
+        // The hart is already halted between steps.
+        LOG("Breaking out of range step\n");
+        put_stop_reply();
+        next_state = SEND_PREFIX;
+      }
       break;
     }
 
@@ -759,168 +2086,102 @@ void GDBServer::update(bool connected, bool byte_ie, char byte_in, bool& byte_oe
     }
 
     case IDLE: {
-      if (byte_ie) {
-        // Wait for start char
-        if (byte_in == '$') {
-          next_state = RECV_PACKET;
-          recv.clear();
-          checksum = 0;
-        }
+      // Wait for start char
+      if (byte_in == '$') {
+        next_state = RECV_PACKET;
+        recv.clear();
+        stream_mode = STREAM_NONE;
+        stream_error = false;
+        checksum = 0;
       }
       break;
     }
 
     case RECV_PACKET: {
-      if (byte_ie) {
-        // Add bytes to packet until we see the end char
-        // Checksum is for the _escaped_ data.
-        if (byte_in == '#') {
-          expected_checksum = 0;
-          next_state = RECV_SUFFIX1;
-        }
-        else if (byte_in == '}') {
-          checksum += byte_in;
-          next_state = RECV_PACKET_ESCAPE;
-        }
-        else {
-          checksum += byte_in;
-          recv.put(byte_in);
-        }
+      // Add bytes to packet until we see the end char
+      // Checksum is for the _escaped_ data.
+      if (byte_in == '#') {
+        expected_checksum = 0;
+        next_state = RECV_SUFFIX1;
+      }
+      else if (byte_in == '}') {
+        checksum += byte_in;
+        next_state = RECV_PACKET_ESCAPE;
+      }
+      else {
+        checksum += byte_in;
+        put_payload(byte_in);
       }
       break;
     }
 
     case RECV_PACKET_ESCAPE: {
-      if (byte_ie) {
-        checksum += byte_in;
-        recv.put(byte_in ^ 0x20);
-        next_state = RECV_PACKET;
-      }
+      checksum += byte_in;
+      put_payload(byte_in ^ 0x20);
+      next_state = RECV_PACKET;
       break;
     }
 
     case RECV_SUFFIX1: {
-      if (byte_ie) {
-        expected_checksum = (expected_checksum << 4) | from_hex(byte_in);
-        next_state = RECV_SUFFIX2;
-      }
+      expected_checksum = (expected_checksum << 4) | from_hex(byte_in);
+      next_state = RECV_SUFFIX2;
       break;
     }
 
     case RECV_SUFFIX2: {
-      if (byte_ie) {
-        expected_checksum = (expected_checksum << 4) | from_hex(byte_in);
-
-        if (checksum != expected_checksum) {
-          LOG_R("\n");
-          LOG_R("Packet transmission error\n");
-          LOG_R("expected checksum 0x%02x\n", expected_checksum);
-          LOG_R("actual checksum   0x%02x\n", checksum);
-          byte_out = '-';
-          byte_oe = true;
-          next_state = IDLE;
-        }
-        else {
-          // Packet checksum OK, handle it.
-          byte_out = '+';
-          byte_oe = true;
-#ifdef DEBUG_REMOTE
-          printf(">> %s\n", recv.buf);
-#endif
-          handle_packet();
-
-          // If handle_packet() changed next_state, don't change it again.
-          if (next_state == RECV_SUFFIX2) {
-            next_state = send.packet_valid ? SEND_PREFIX : IDLE;
-          }
-        }
+      expected_checksum = (expected_checksum << 4) | from_hex(byte_in);
+
+      if (checksum != expected_checksum) {
+        LOG_R("\n");
+        LOG_R("Packet transmission error\n");
+        LOG_R("expected checksum 0x%02x\n", expected_checksum);
+        LOG_R("actual checksum   0x%02x\n", checksum);
+        ack_out = no_ack ? 0 : '-';
+        next_state = IDLE;
+
+        // Anything we already streamed out will be overwritten when GDB
+        // resends the packet, but a partial flash page must not be kept.
+        if (stream_mode == STREAM_FLASH) discard_flash_cache();
+        stream_mode = STREAM_NONE;
       }
-      break;
-    }
-
-    case SEND_PREFIX: {
+      else {
+        // Packet checksum OK, handle it.
+        ack_out = no_ack ? 0 : '+';
 #ifdef DEBUG_REMOTE
-      printf("<<   %s\n", send.buf);
+        printf(">> %s\n", recv.buf);
 #endif
-      byte_out = '$';
-      byte_oe = true;
-      checksum = 0;
-      next_state = send.size ? SEND_PACKET : SEND_SUFFIX1;
-      send.cursor2 = send.buf;
-      break;
-    }
+        handle_packet();
 
-    case SEND_PACKET: {
-      char c = *send.cursor2;
-      if (c == '#' || c == '$' || c == '}' || c == '*') {
-        checksum += '}';
-        byte_out = '}';
-        byte_oe = true;
-        next_state = SEND_PACKET_ESCAPE;
-        break;
-      }
-      else {
-        checksum += c;
-        byte_out = c;
-        byte_oe = true;
-        send.cursor2++;
-        if ((send.cursor2 - send.buf) == send.size) {
-          next_state = SEND_SUFFIX1;
+        // If handle_packet() changed next_state, don't change it again.
+        if (next_state == RECV_SUFFIX2) {
+          next_state = send.packet_valid ? SEND_PREFIX : IDLE;
         }
-        break;
       }
-    }
-
-    case SEND_PACKET_ESCAPE: {
-      char c = *send.cursor2;
-      checksum += c ^ 0x20;
-      byte_out = c ^ 0x20;
-      byte_oe = true;
-      next_state = SEND_PACKET;
       break;
     }
 
-    case SEND_SUFFIX1:
-      byte_out = '#';
-      byte_oe = true;
-      next_state = SEND_SUFFIX2;
-      break;
-
-    case SEND_SUFFIX2:
-      byte_out = to_hex((checksum >> 4) & 0xF);
-      byte_oe = true;
-      next_state = SEND_SUFFIX3;
-      break;
-
-    case SEND_SUFFIX3:
-      byte_out = to_hex((checksum >> 0) & 0xF);
-      byte_oe = true;
-      next_state = RECV_ACK;
-      break;
-
-
     case RECV_ACK: {
-      if (byte_ie) {
-        if (byte_in == '+') {
-          //printf("\n>> ");
-          next_state = IDLE;
-        }
-        else if (byte_in == '-') {
-          LOG_R("========================\n");
-          LOG_R("========  NACK  ========\n");
-          LOG_R("========================\n");
-          next_state = SEND_PACKET;
-        }
-        else {
-          LOG_R("garbage ack char %d '%c'\n", byte_in, byte_in);
+      if (byte_in == '+') {
+        //printf("\n>> ");
+        if (no_ack_pending) {
+          no_ack = true;
+          no_ack_pending = false;
         }
+        next_state = IDLE;
+      }
+      else if (byte_in == '-') {
+        LOG_R("========================\n");
+        LOG_R("========  NACK  ========\n");
+        LOG_R("========================\n");
+        next_state = SEND_PREFIX;
+      }
+      else {
+        LOG_R("garbage ack char %d '%c'\n", byte_in, byte_in);
       }
       break;
     }
   }
 
-  //----------------------------------------
-
   state = next_state;
 }
 
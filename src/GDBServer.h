@@ -1,21 +1,27 @@
 #pragma once
 #include "utils.h"
 #include "Packet.h"
+#include "WCHChip.h"
 
 struct RVDebug;
 struct WCHFlash;
 struct SoftBreak;
+struct AgentExpr;
+struct Trace;
 
 //------------------------------------------------------------------------------
 
 struct GDBServer {
 public:
 
-  GDBServer(RVDebug* rvd, WCHFlash* flash, SoftBreak* soft);
+  GDBServer(const WCHChip& chip, RVDebug* rvd, WCHFlash* flash, SoftBreak* soft);
   void reset();
   void dump();
 
-  void update(bool connected, bool byte_ie, char byte_in, bool& byte_oe, char& byte_out);
+  // Bulk I/O - update() feeds received bytes to the parser and returns how
+  // many it consumed, get_output() encodes pending output into 'out'.
+  int  update(bool connected, const char* in, int in_size);
+  int  get_output(char* out, int max);
 
 //private:
 
@@ -41,6 +47,8 @@ public:
   void handle_k();
   void handle_m();
   void handle_M();
+  void handle_x();
+  void handle_X();
   void handle_p();
   void handle_P();
   void handle_q();
@@ -48,34 +56,106 @@ public:
   void handle_R();
   void handle_s();
   void handle_v();
+  void handle_vCont();
   void handle_z0();
   void handle_Z0();
   void handle_z1();
   void handle_Z1();
+  void handle_watch();
+  void handle_trace();
+  void handle_QTDP();
+  void handle_QTFrame();
 
 //private:
 
+  void on_byte(char c);
+  int  count_run(char c);
+  void put_payload(char c);
+  void start_stream();
+  void stream_byte(char c);
+  void stream_mem(uint8_t b);
+  void flush_stream();
+  void read_mem(uint32_t src, uint8_t* dst, int len);
+  void write_mem(uint32_t dst, uint8_t* src, int len);
   void handle_packet();
   void on_hit_breakpoint();
+  void render_memory_map();
+  void render_target_xml();
+  void put_stop_reply(const char* reason = nullptr, uint32_t addr = 0);
+  bool add_watch(uint32_t addr, int len);
+  void remove_watch(uint32_t addr, int len);
+  void refresh_watches();
+  void sample_watches();
+  void resume_target();
+  void continue_target();
+  bool set_user_break(uint32_t addr, int kind);
+  bool take_conditions(uint32_t addr);
+  void clear_conditions(uint32_t addr);
+  bool condition_true(uint32_t addr);
+  bool should_stop(uint32_t addr);
+  int  take_code(uint8_t* code);
+  void put_frame_regs(int reg);
+  void put_frame_mem(uint32_t src, int len, bool binary);
+  void step_range();
+  void put_xfer_chunk(const char* doc, int doc_size, int offset, int length);
 
   void flash_erase(int addr, int size);
+  void finish_flash_erase();
   void put_flash_cache(int addr, uint8_t data);
   void flush_flash_cache();
+  void discard_flash_cache();
+  const uint8_t* read_flash_page(int addr);
 
+  WCHChip chip;
   RVDebug* rvd = nullptr;
   WCHFlash* flash = nullptr;
   SoftBreak* soft = nullptr;
+  AgentExpr* agent = nullptr;
+  Trace* trace = nullptr;
 
   Packet   send;
   Packet   recv;
 
+  // Streaming writes - payload bytes of vFlashWrite and M packets go straight
+  // to flash or memory instead of into recv.
+  enum {
+    STREAM_NONE,
+    STREAM_FLASH,
+    STREAM_MEM_HEX,
+    STREAM_MEM_BIN,
+  };
+
+  int      stream_mode = STREAM_NONE;
+  uint32_t stream_addr = 0;
+  int      stream_count = 0;  // Payload bytes received
+  int      stream_nibble = -1;
+  bool     stream_error = false;
+  uint8_t  stream_buf[64];
+  int      stream_size = 0;
+
+  char     memory_map[512];
+  int      memory_map_size = 0;
+
+  static const int reg_pc = 32; // GDB's register number for pc
+  char     target_xml[2048];
+  int      target_xml_size = 0;
+
   uint8_t* page_cache;
+  uint8_t* page_mask; // Nonzero if the byte in page_cache has been written
   int      page_base = -1;
-  uint64_t page_bitmap = 0;
+  int      page_fill = 0;
+
+  // Differential flash programming - vFlashErase only marks pages as pending,
+  // and the erase happens when we know the new page contents differ from what
+  // is already on the chip.
+  bool     diff_flash = true;
+  uint8_t* page_readback;
+  uint8_t* erase_map; // Nonzero if GDB asked for this page to be erased
 
   enum {
     DISCONNECTED,
     RUNNING,
+    STEPPING,
     KILLED,
     IDLE,
     RECV_PACKET,
@@ -86,6 +166,8 @@ public:
     SEND_PREFIX,
     SEND_PACKET,
     SEND_PACKET_ESCAPE,
+    SEND_RUN_STAR,
+    SEND_RUN_COUNT,
     SEND_SUFFIX1,
     SEND_SUFFIX2,
     SEND_SUFFIX3,
@@ -93,11 +175,55 @@ public:
     RECV_ACK,
   };
 
+  bool sending() const { return state >= SEND_PREFIX && state <= SEND_SUFFIX3; }
+
   int state = DISCONNECTED;
   int next_state = DISCONNECTED;
+  char ack_out = 0;
+  bool no_ack = false;          // QStartNoAckMode negotiated
+  bool no_ack_pending = false;  // Switch once GDB acks our OK
   char expected_checksum = 0;
   uint8_t checksum = 0;
+  int run_count = 0; // Repeats of the last sent character to encode as "*n"
   uint32_t last_halt_check;
+
+  // Sampled write watchpoints for chips without data triggers
+  static const int watch_max = 8;
+  static const int watch_len_max = 16;
+
+  struct Watch {
+    uint32_t addr;
+    int      len;
+    uint8_t  last[watch_len_max];
+  };
+
+  Watch    watches[watch_max];
+  int      watch_count = 0;
+  uint32_t watch_interval = 10000; // microseconds, tunable via "monitor watch"
+  uint32_t last_watch_check = 0;
+
+  // Breakpoint conditions from Z0/Z1, as agent expression bytecode
+  static const int cond_max = 16;
+  static const int cond_code_max = 64;
+  static const int cond_skip_max = 64; // False hits to skip while resuming
+
+  struct Cond {
+    uint32_t addr;
+    int      len;
+    uint8_t  code[cond_code_max];
+  };
+
+  Cond     conds[cond_max];
+  int      cond_count = 0;
+
+  // Halt polling while running - microseconds, tunable via "monitor poll"
+  uint32_t poll_min = 200;
+  uint32_t poll_max = 100000;
+  uint32_t poll_interval = 200;
+
+  static const int range_step_batch = 32; // Steps per update() while range stepping
+  uint32_t step_start = 0;
+  uint32_t step_end = 0;
 };
 
 //------------------------------------------------------------------------------
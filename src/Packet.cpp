@@ -4,6 +4,16 @@
 
 //------------------------------------------------------------------------------
 
+static char packet_arena[packet_buf_count][packet_buf_size];
+static int  packet_arena_used = 0;
+
+char* alloc_packet_buf() {
+  CHECK(packet_arena_used < packet_buf_count, "Packet arena exhausted");
+  return packet_arena[packet_arena_used++];
+}
+
+//------------------------------------------------------------------------------
+
 bool parse_binary_literal(const char*& cursor, int& out) {
   int accum = 0;
   int sign = 1;
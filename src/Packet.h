@@ -10,10 +10,29 @@ enum class ParseError {
   ERROR
 };
 
+//------------------------------------------------------------------------------
+// Packet buffers come out of a small static arena instead of being embedded in
+// each Packet. They're sized to the PacketSize we advertise to GDB - large
+// flash and memory writes are streamed and never land in a Packet.
+
+static const int packet_buf_size = 4096;
+static const int packet_buf_count = 3; // GDB send + recv, console
+
+char* alloc_packet_buf();
+
+//------------------------------------------------------------------------------
+
 struct Packet {
 
+  Packet() {
+    buf = alloc_packet_buf();
+    buf_size = packet_buf_size;
+    clear();
+  }
+
+  // Contents past 'size' are stale, but the buffer is always NUL-terminated.
   void clear() {
-    memset(buf, 0, sizeof(buf));
+    buf[0] = 0;
     size = 0;
     error = false;
     cursor2 = buf;
@@ -301,7 +320,12 @@ struct Packet {
   }
 
   void put(char c) {
+    if (size >= buf_size - 1) {
+      error = true;
+      return;
+    }
     *cursor2++ = c;
+    *cursor2 = 0;
     size++;
   }
 
@@ -336,6 +360,14 @@ struct Packet {
     }
   }
 
+  // Raw bytes, escaped on the way out by GDBServer
+  void put_blob(const void* blob, int size) {
+    const uint8_t* src = (const uint8_t*)blob;
+    for (int i = 0; i < size; i++) {
+      put(src[i]);
+    }
+  }
+
   void end_packet() {
     packet_valid = true;
   }
@@ -346,12 +378,11 @@ struct Packet {
 
   //----------------------------------------
 
-  int    sentinel1 = 0xDEADBEEF;
-  char   buf[16384];
-  int    sentinel2 = 0xF00DCAFE;
+  char*  buf;
+  int    buf_size;
   int    size = 0;
   bool   error = false;
   //int    cursor = 0;
-  char*  cursor2 = buf;
+  char*  cursor2;
   bool   packet_valid = false;
 };
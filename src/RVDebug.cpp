@@ -283,7 +283,7 @@ void RVDebug::set_dscratch1(uint32_t r) { set_csr(CSR_DSCRATCH1, r); }
 // Getting multiple GPRs via autoexec is not supported on CH32V003 :/
 
 uint32_t RVDebug::get_gpr(int index) {
-  if (index == 16) {
+  if (index == reg_count) {
     return get_dpc();
   }
 
@@ -299,7 +299,7 @@ uint32_t RVDebug::get_gpr(int index) {
 //------------------------------------------------------------------------------
 
 void RVDebug::set_gpr(int index, uint32_t gpr) {
-  if (index == 16) {
+  if (index == reg_count) {
     set_dpc(gpr);
     return;
   } else {
@@ -314,6 +314,28 @@ void RVDebug::set_gpr(int index, uint32_t gpr) {
   }
 }
 
+//------------------------------------------------------------------------------
+// A dirty reg gets reg_cache written back on resume, so writes have to land
+// there. A clean reg that's also cached has to keep the two in sync.
+
+uint32_t RVDebug::get_user_gpr(int index) {
+  if (index < reg_count && bit(dirty_regs, index)) {
+    return reg_cache[index];
+  }
+  return get_gpr(index);
+}
+
+void RVDebug::set_user_gpr(int index, uint32_t gpr) {
+  if (index < reg_count && bit(dirty_regs, index)) {
+    reg_cache[index] = gpr;
+    return;
+  }
+  set_gpr(index, gpr);
+  if (index < reg_count && bit(cached_regs, index)) {
+    reg_cache[index] = gpr;
+  }
+}
+
 //------------------------------------------------------------------------------
 
 void RVDebug::reload_regs() {
@@ -361,6 +383,93 @@ void RVDebug::set_csr(int index, uint32_t data) {
 
 //------------------------------------------------------------------------------
 
+bool RVDebug::get_csr_checked(int index, uint32_t& data) {
+  data = get_csr(index);
+  auto abstractcs = get_abstractcs();
+  while (abstractcs.BUSY) abstractcs = get_abstractcs();
+  if (abstractcs.CMDER) {
+    clear_err();
+    return false;
+  }
+  return true;
+}
+
+bool RVDebug::set_csr_checked(int index, uint32_t data) {
+  set_csr(index, data);
+  auto abstractcs = get_abstractcs();
+  while (abstractcs.BUSY) abstractcs = get_abstractcs();
+  if (abstractcs.CMDER) {
+    clear_err();
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Walk tselect until it stops sticking or the trigger reports type 0 (none).
+// Parts without Sdtrig (CH32V003) fail on the first tselect access.
+
+int RVDebug::count_triggers() {
+  const int trigger_max = 16;
+
+  int count = 0;
+  for (int i = 0; i < trigger_max; i++) {
+    uint32_t tselect = 0;
+    uint32_t tdata1 = 0;
+    if (!set_csr_checked(CSR_TSELECT, i)) break;
+    if (!get_csr_checked(CSR_TSELECT, tselect) || tselect != (uint32_t)i) break;
+    if (!get_csr_checked(CSR_TDATA1, tdata1)) break;
+
+    int type = tdata1 >> 28;
+    if (type == CSR_TDATA1_TYPE_NONE) break;
+
+    // Only address/data match triggers are any use to us.
+    // tinfo is optional, if it's missing we go by the current type.
+    uint32_t tinfo = 0;
+    if (get_csr_checked(CSR_TINFO, tinfo)) {
+      uint32_t types = tinfo & CSR_TINFO_INFO;
+      if (!(types & ((1 << CSR_TDATA1_TYPE_MCONTROL) | (1 << CSR_TDATA1_TYPE_MCONTROL6)))) break;
+    }
+    else if (type != CSR_TDATA1_TYPE_MCONTROL && type != CSR_TDATA1_TYPE_MCONTROL6) {
+      break;
+    }
+
+    count++;
+  }
+
+  return count;
+}
+
+//----------
+// tdata1 is cleared first so the trigger can't fire on a half-written
+// configuration.
+
+bool RVDebug::set_trigger(int index, uint32_t tdata1, uint32_t tdata2) {
+  if (!set_csr_checked(CSR_TSELECT, index)) return false;
+  if (!set_csr_checked(CSR_TDATA1, 0)) return false;
+  if (!set_csr_checked(CSR_TDATA2, tdata2)) return false;
+  if (!set_csr_checked(CSR_TDATA1, tdata1)) return false;
+
+  // Unsupported configurations read back differently (WARL), including NAPOT
+  // masks wider than the trigger supports.
+  uint32_t readback1 = 0;
+  uint32_t readback2 = 0;
+  return get_csr_checked(CSR_TDATA1, readback1) && readback1 == tdata1 &&
+         get_csr_checked(CSR_TDATA2, readback2) && readback2 == tdata2;
+}
+
+bool RVDebug::get_trigger(int index, uint32_t& tdata1) {
+  if (!set_csr_checked(CSR_TSELECT, index)) return false;
+  return get_csr_checked(CSR_TDATA1, tdata1);
+}
+
+bool RVDebug::clear_trigger(int index) {
+  if (!set_csr_checked(CSR_TSELECT, index)) return false;
+  return set_csr_checked(CSR_TDATA1, 0);
+}
+
+//------------------------------------------------------------------------------
+
 bool RVDebug::clear_err() {
   auto abstractcs = get_abstractcs();
   abstractcs.CMDER = 7;
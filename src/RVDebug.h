@@ -103,12 +103,31 @@ struct RVDebug {
   uint32_t get_gpr(int index);
   void     set_gpr(int index, uint32_t gpr);
 
+  // The program's view of the GPRs. Running a debug program clobbers some of
+  // them until the next resume, so these go through our saved copy of any
+  // reg that's currently dirty.
+  uint32_t get_user_gpr(int index);
+  void     set_user_gpr(int index, uint32_t gpr);
+
   //----------
   // CSR access
 
   uint32_t get_csr(int index);
   void     set_csr(int index, uint32_t csr);
 
+  // Same as above, but returns false (and clears CMDER) if the CSR doesn't
+  // exist on this hart.
+  bool     get_csr_checked(int index, uint32_t& csr);
+  bool     set_csr_checked(int index, uint32_t csr);
+
+  //----------
+  // Sdtrig triggers. Hart must be halted.
+
+  int      count_triggers();
+  bool     get_trigger(int index, uint32_t& tdata1);
+  bool     set_trigger(int index, uint32_t tdata1, uint32_t tdata2);
+  bool     clear_trigger(int index);
+
   //----------
   // Memory access
 
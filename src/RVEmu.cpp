@@ -0,0 +1,375 @@
+#include "RVEmu.h"
+
+#include "RVDebug.h"
+#include "utils.h"
+
+enum {
+  ALU_ADD, ALU_SUB, ALU_SLL, ALU_SLT, ALU_SLTU, ALU_XOR, ALU_SRL, ALU_SRA,
+  ALU_OR, ALU_AND,
+  ALU_MUL, ALU_MULH, ALU_MULHSU, ALU_MULHU, ALU_DIV, ALU_DIVU, ALU_REM, ALU_REMU,
+};
+
+// funct3 -> ALU function for OP/OP-IMM with funct7 == 0
+static const int alu_tab[8] = {
+  ALU_ADD, ALU_SLL, ALU_SLT, ALU_SLTU, ALU_XOR, ALU_SRL, ALU_OR, ALU_AND
+};
+
+static const int reg_sp = 2;
+static const int reg_ra = 1;
+
+// Pulls 'len' bits starting at 'lo' out of 'x'.
+static uint32_t bits(uint32_t x, int lo, int len) {
+  return (x >> lo) & ((1u << len) - 1);
+}
+
+// Sign extends from bit 'top'.
+static int32_t sext(uint32_t x, int top) {
+  int shift = 31 - top;
+  return int32_t(x << shift) >> shift;
+}
+
+//------------------------------------------------------------------------------
+
+bool RVEmu::step(uint32_t pc, uint32_t insn) {
+  Op op = {};
+  bool ok = (insn & 3) == 3 ? decode(insn, op) : decode_c(uint16_t(insn), op);
+  if (!ok) return false;
+
+  int gpr_count = rvd->get_gpr_count();
+  if (op.rd >= gpr_count || op.rs1 >= gpr_count || op.rs2 >= gpr_count) return false;
+
+  // The loads and stores below run debug programs that clobber a0/a1, so all
+  // register traffic goes through RVDebug's saved copies.
+  uint32_t a = op.rs1 ? rvd->get_user_gpr(op.rs1) : 0;
+  uint32_t b = op.rs2 ? rvd->get_user_gpr(op.rs2) : 0;
+  uint32_t next = pc + op.len;
+  uint32_t result = 0;
+
+  switch (op.kind) {
+    case EMU_ALU:
+      result = alu(op.func, a, op.use_imm ? uint32_t(op.imm) : b);
+      break;
+
+    case EMU_AUIPC:
+      result = pc + op.imm;
+      break;
+
+    case EMU_LOAD: {
+      int size = 1 << (op.func & 3);
+      if (!bus->emu_load(a + op.imm, size, result)) return false;
+      if (!(op.func & 4) && size < 4) result = sext(result, size * 8 - 1);
+      break;
+    }
+
+    case EMU_STORE:
+      if (!bus->emu_store(a + op.imm, 1 << op.func, b)) return false;
+      break;
+
+    case EMU_BRANCH: {
+      bool taken = false;
+      switch (op.func) {
+        case 0: taken = a == b; break;
+        case 1: taken = a != b; break;
+        case 4: taken = int32_t(a) <  int32_t(b); break;
+        case 5: taken = int32_t(a) >= int32_t(b); break;
+        case 6: taken = a <  b; break;
+        case 7: taken = a >= b; break;
+      }
+      if (taken) next = pc + op.imm;
+      break;
+    }
+
+    case EMU_JAL:
+      result = pc + op.len;
+      next = pc + op.imm;
+      break;
+
+    case EMU_JALR:
+      result = pc + op.len;
+      next = (a + op.imm) & ~1u;
+      break;
+  }
+
+  bool writes_rd = op.kind != EMU_STORE && op.kind != EMU_BRANCH;
+  if (writes_rd && op.rd) rvd->set_user_gpr(op.rd, result);
+  rvd->set_dpc(next);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Division follows the spec - no traps, x/0 is all ones, x%0 is x, and
+// INT_MIN/-1 overflows to INT_MIN.
+
+uint32_t RVEmu::alu(int func, uint32_t a, uint32_t b) {
+  int32_t sa = int32_t(a);
+  int32_t sb = int32_t(b);
+
+  switch (func) {
+    case ALU_ADD:    return a + b;
+    case ALU_SUB:    return a - b;
+    case ALU_SLL:    return a << (b & 31);
+    case ALU_SLT:    return sa < sb;
+    case ALU_SLTU:   return a < b;
+    case ALU_XOR:    return a ^ b;
+    case ALU_SRL:    return a >> (b & 31);
+    case ALU_SRA:    return uint32_t(sa >> (b & 31));
+    case ALU_OR:     return a | b;
+    case ALU_AND:    return a & b;
+    case ALU_MUL:    return a * b;
+    case ALU_MULH:   return uint32_t((int64_t(sa) * int64_t(sb)) >> 32);
+    case ALU_MULHSU: return uint32_t((int64_t(sa) * int64_t(uint64_t(b))) >> 32);
+    case ALU_MULHU:  return uint32_t((uint64_t(a) * uint64_t(b)) >> 32);
+    case ALU_DIV:    return b == 0 ? 0xFFFFFFFF : (sa == INT32_MIN && sb == -1) ? a : uint32_t(sa / sb);
+    case ALU_DIVU:   return b == 0 ? 0xFFFFFFFF : a / b;
+    case ALU_REM:    return b == 0 ? a : (sa == INT32_MIN && sb == -1) ? 0 : uint32_t(sa % sb);
+    case ALU_REMU:   return b == 0 ? a : a % b;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+bool RVEmu::decode(uint32_t insn, Op& op) {
+  int opcode = bits(insn, 0, 7);
+  int f3     = bits(insn, 12, 3);
+  int f7     = bits(insn, 25, 7);
+
+  op.len = 4;
+  op.rd  = bits(insn, 7, 5);
+  op.rs1 = bits(insn, 15, 5);
+  op.rs2 = 0;
+
+  int32_t imm_i = int32_t(insn) >> 20;
+  int32_t imm_s = ((int32_t(insn) >> 25) << 5) | bits(insn, 7, 5);
+  int32_t imm_b = sext((bits(insn, 31, 1) << 12) | (bits(insn, 7, 1) << 11) |
+                       (bits(insn, 25, 6) << 5)  | (bits(insn, 8, 4) << 1), 12);
+  int32_t imm_u = int32_t(insn & 0xFFFFF000);
+  int32_t imm_j = sext((bits(insn, 31, 1) << 20) | (bits(insn, 12, 8) << 12) |
+                       (bits(insn, 20, 1) << 11) | (bits(insn, 21, 10) << 1), 20);
+
+  switch (opcode) {
+    case 0x37: // lui
+      op.kind = EMU_ALU; op.func = ALU_ADD; op.rs1 = 0; op.use_imm = true; op.imm = imm_u;
+      return true;
+
+    case 0x17: // auipc
+      op.kind = EMU_AUIPC; op.rs1 = 0; op.imm = imm_u;
+      return true;
+
+    case 0x6F: // jal
+      op.kind = EMU_JAL; op.rs1 = 0; op.imm = imm_j;
+      return true;
+
+    case 0x67: // jalr
+      if (f3 != 0) return false;
+      op.kind = EMU_JALR; op.imm = imm_i;
+      return true;
+
+    case 0x63: // beq/bne/blt/bge/bltu/bgeu
+      if (f3 == 2 || f3 == 3) return false;
+      op.kind = EMU_BRANCH; op.func = f3; op.rd = 0; op.rs2 = bits(insn, 20, 5); op.imm = imm_b;
+      return true;
+
+    case 0x03: // lb/lh/lw/lbu/lhu
+      if (f3 == 3 || f3 >= 6) return false;
+      op.kind = EMU_LOAD; op.func = f3; op.imm = imm_i;
+      return true;
+
+    case 0x23: // sb/sh/sw
+      if (f3 > 2) return false;
+      op.kind = EMU_STORE; op.func = f3; op.rd = 0; op.rs2 = bits(insn, 20, 5); op.imm = imm_s;
+      return true;
+
+    case 0x13: // op-imm
+      op.kind = EMU_ALU; op.use_imm = true; op.imm = imm_i; op.func = alu_tab[f3];
+      if (f3 == 1) {
+        if (f7 != 0) return false;
+        op.imm &= 31;
+      }
+      else if (f3 == 5) {
+        if (f7 != 0 && f7 != 0x20) return false;
+        if (f7 == 0x20) op.func = ALU_SRA;
+        op.imm &= 31;
+      }
+      return true;
+
+    case 0x33: // op
+      op.kind = EMU_ALU; op.rs2 = bits(insn, 20, 5);
+      if (f7 == 0) {
+        op.func = alu_tab[f3];
+      }
+      else if (f7 == 0x20 && f3 == 0) {
+        op.func = ALU_SUB;
+      }
+      else if (f7 == 0x20 && f3 == 5) {
+        op.func = ALU_SRA;
+      }
+      else if (f7 == 0x01) {
+        op.func = ALU_MUL + f3;
+      }
+      else {
+        return false;
+      }
+      return true;
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Compressed instructions, expanded to their 32-bit equivalents. Quadrant 0
+// slots that RV32C leaves free are where WCH puts its XW extension, so those
+// (along with everything else we don't list) go to the hart.
+
+bool RVEmu::decode_c(uint16_t insn, Op& op) {
+  int quad = bits(insn, 0, 2);
+  int f3   = bits(insn, 13, 3);
+
+  int rd     = bits(insn, 7, 5);       // Also rs1
+  int rs2    = bits(insn, 2, 5);
+  int rd_p   = 8 + bits(insn, 2, 3);   // rd' / rs2'
+  int rs1_p  = 8 + bits(insn, 7, 3);   // rs1' / rd'
+
+  int32_t imm6 = sext((bits(insn, 12, 1) << 5) | bits(insn, 2, 5), 5);
+  int32_t imm_j = sext((bits(insn, 12, 1) << 11) | (bits(insn, 11, 1) << 4) |
+                       (bits(insn, 9, 2) << 8)   | (bits(insn, 8, 1) << 10) |
+                       (bits(insn, 7, 1) << 6)   | (bits(insn, 6, 1) << 7) |
+                       (bits(insn, 3, 3) << 1)   | (bits(insn, 2, 1) << 5), 11);
+  int32_t imm_b = sext((bits(insn, 12, 1) << 8) | (bits(insn, 10, 2) << 3) |
+                       (bits(insn, 5, 2) << 6)  | (bits(insn, 3, 2) << 1) |
+                       (bits(insn, 2, 1) << 5), 8);
+  int32_t uimm_w = (bits(insn, 10, 3) << 3) | (bits(insn, 6, 1) << 2) | (bits(insn, 5, 1) << 6);
+
+  op.len = 2;
+  op.use_imm = false;
+  op.rs2 = 0;
+
+  if (quad == 0) {
+    if (f3 == 0) { // c.addi4spn
+      int32_t nzuimm = (bits(insn, 11, 2) << 4) | (bits(insn, 7, 4) << 6) |
+                       (bits(insn, 6, 1) << 2)  | (bits(insn, 5, 1) << 3);
+      if (!nzuimm) return false;
+      op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd_p; op.rs1 = reg_sp;
+      op.use_imm = true; op.imm = nzuimm;
+      return true;
+    }
+    if (f3 == 2) { // c.lw
+      op.kind = EMU_LOAD; op.func = 2; op.rd = rd_p; op.rs1 = rs1_p; op.imm = uimm_w;
+      return true;
+    }
+    if (f3 == 6) { // c.sw
+      op.kind = EMU_STORE; op.func = 2; op.rd = 0; op.rs1 = rs1_p; op.rs2 = rd_p; op.imm = uimm_w;
+      return true;
+    }
+    return false;
+  }
+
+  if (quad == 1) {
+    switch (f3) {
+      case 0: // c.addi, c.nop
+        op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd; op.rs1 = rd; op.use_imm = true; op.imm = imm6;
+        return true;
+
+      case 1: // c.jal
+        op.kind = EMU_JAL; op.rd = reg_ra; op.rs1 = 0; op.imm = imm_j;
+        return true;
+
+      case 2: // c.li
+        op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd; op.rs1 = 0; op.use_imm = true; op.imm = imm6;
+        return true;
+
+      case 3:
+        if (rd == reg_sp) { // c.addi16sp
+          int32_t nzimm = sext((bits(insn, 12, 1) << 9) | (bits(insn, 6, 1) << 4) |
+                               (bits(insn, 5, 1) << 6)  | (bits(insn, 3, 2) << 7) |
+                               (bits(insn, 2, 1) << 5), 9);
+          if (!nzimm) return false;
+          op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = reg_sp; op.rs1 = reg_sp;
+          op.use_imm = true; op.imm = nzimm;
+          return true;
+        }
+        else { // c.lui
+          if (!imm6) return false;
+          op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd; op.rs1 = 0;
+          op.use_imm = true; op.imm = imm6 << 12;
+          return true;
+        }
+
+      case 4: {
+        op.kind = EMU_ALU; op.rd = rs1_p; op.rs1 = rs1_p;
+        int f2 = bits(insn, 10, 2);
+        if (f2 == 0 || f2 == 1) { // c.srli, c.srai
+          if (bits(insn, 12, 1)) return false;
+          op.func = f2 ? ALU_SRA : ALU_SRL; op.use_imm = true; op.imm = bits(insn, 2, 5);
+          return true;
+        }
+        if (f2 == 2) { // c.andi
+          op.func = ALU_AND; op.use_imm = true; op.imm = imm6;
+          return true;
+        }
+        if (bits(insn, 12, 1)) return false;
+        static const int ops[4] = { ALU_SUB, ALU_XOR, ALU_OR, ALU_AND };
+        op.func = ops[bits(insn, 5, 2)]; op.rs2 = rd_p; // c.sub, c.xor, c.or, c.and
+        return true;
+      }
+
+      case 5: // c.j
+        op.kind = EMU_JAL; op.rd = 0; op.rs1 = 0; op.imm = imm_j;
+        return true;
+
+      case 6: // c.beqz
+      case 7: // c.bnez
+        op.kind = EMU_BRANCH; op.func = f3 == 6 ? 0 : 1; op.rd = 0; op.rs1 = rs1_p; op.rs2 = 0; op.imm = imm_b;
+        return true;
+    }
+    return false;
+  }
+
+  if (quad == 2) {
+    switch (f3) {
+      case 0: // c.slli
+        if (bits(insn, 12, 1)) return false;
+        op.kind = EMU_ALU; op.func = ALU_SLL; op.rd = rd; op.rs1 = rd; op.use_imm = true; op.imm = rs2;
+        return true;
+
+      case 2: { // c.lwsp
+        if (!rd) return false;
+        int32_t uimm = (bits(insn, 12, 1) << 5) | (bits(insn, 4, 3) << 2) | (bits(insn, 2, 2) << 6);
+        op.kind = EMU_LOAD; op.func = 2; op.rd = rd; op.rs1 = reg_sp; op.imm = uimm;
+        return true;
+      }
+
+      case 4:
+        if (!bits(insn, 12, 1)) {
+          if (!rs2) { // c.jr
+            if (!rd) return false;
+            op.kind = EMU_JALR; op.rd = 0; op.rs1 = rd; op.imm = 0;
+          }
+          else { // c.mv
+            op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd; op.rs1 = 0; op.rs2 = rs2;
+          }
+        }
+        else {
+          if (!rs2) { // c.jalr (c.ebreak when rd == 0)
+            if (!rd) return false;
+            op.kind = EMU_JALR; op.rd = reg_ra; op.rs1 = rd; op.imm = 0;
+          }
+          else { // c.add
+            op.kind = EMU_ALU; op.func = ALU_ADD; op.rd = rd; op.rs1 = rd; op.rs2 = rs2;
+          }
+        }
+        return true;
+
+      case 6: { // c.swsp
+        int32_t uimm = (bits(insn, 9, 4) << 2) | (bits(insn, 7, 2) << 6);
+        op.kind = EMU_STORE; op.func = 2; op.rd = 0; op.rs1 = reg_sp; op.rs2 = rs2; op.imm = uimm;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
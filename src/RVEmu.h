@@ -0,0 +1,67 @@
+// Tiny RV32I/E + M + C interpreter, used to step over an instruction that has
+// a breakpoint sitting on top of it in flash. SoftBreak hands it the original
+// instruction from its clean copy of flash, and it updates the GPRs, memory
+// and DPC through RVDebug as if the hart had executed it - so the breakpoint
+// never has to come out of flash.
+//
+// Anything that isn't a plain ALU op, load/store, branch or jump (CSRs,
+// fences, ecall/ebreak, WCH's custom extensions) is left to the real hart.
+
+#pragma once
+#include <stdint.h>
+
+struct RVDebug;
+
+//------------------------------------------------------------------------------
+// Memory the interpreter is allowed to touch. Returning false makes step()
+// give up before it has changed anything.
+
+struct EmuBus {
+  virtual bool emu_load(uint32_t addr, int size, uint32_t& data) = 0;
+  virtual bool emu_store(uint32_t addr, int size, uint32_t data) = 0;
+};
+
+//------------------------------------------------------------------------------
+
+struct RVEmu {
+  RVEmu(RVDebug* rvd, EmuBus* bus) : rvd(rvd), bus(bus) {}
+
+  // Executes 'insn' (16 or 32 bits, from the clean copy of flash) as if it
+  // were at 'pc' and sets DPC to the next instruction. Returns false, with
+  // the hart untouched, if it can't.
+  bool step(uint32_t pc, uint32_t insn);
+
+  //----------------------------------------
+
+private:
+
+  enum {
+    EMU_ALU,
+    EMU_AUIPC,
+    EMU_LOAD,
+    EMU_STORE,
+    EMU_BRANCH,
+    EMU_JAL,
+    EMU_JALR,
+  };
+
+  struct Op {
+    int      kind;
+    int      func;     // ALU function, branch condition or load/store funct3
+    int      rd;
+    int      rs1;
+    int      rs2;
+    bool     use_imm;  // ALU second operand is 'imm' instead of rs2
+    int32_t  imm;
+    int      len;      // 2 or 4
+  };
+
+  bool decode(uint32_t insn, Op& op);
+  bool decode_c(uint16_t insn, Op& op);
+  uint32_t alu(int func, uint32_t a, uint32_t b);
+
+  RVDebug* rvd;
+  EmuBus*  bus;
+};
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+// Lock-free single-producer single-consumer byte queue, used to pass USB
+// traffic between the two RP2040 cores. One core only ever calls put(), the
+// other only ever calls get(). Size must be a power of two.
+
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+//------------------------------------------------------------------------------
+
+template<int size>
+struct SPSCQueue {
+  static_assert((size & (size - 1)) == 0, "SPSCQueue size must be a power of two");
+
+  int used() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  int space() const {
+    return size - used();
+  }
+
+  // Producer side - returns the number of bytes actually queued.
+  int put(const char* src, int len) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+    int avail = size - int(h - t);
+    if (len > avail) len = avail;
+
+    for (int i = 0; i < len; i++) {
+      buf[(h + i) & (size - 1)] = src[i];
+    }
+    head.store(h + len, std::memory_order_release);
+    return len;
+  }
+
+  // Consumer side - returns the number of bytes actually dequeued.
+  int get(char* dst, int len) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t h = head.load(std::memory_order_acquire);
+    int avail = int(h - t);
+    if (len > avail) len = avail;
+
+    for (int i = 0; i < len; i++) {
+      dst[i] = buf[(t + i) & (size - 1)];
+    }
+    tail.store(t + len, std::memory_order_release);
+    return len;
+  }
+
+  // Consumer side - throw away everything queued so far. Only safe while the
+  // producer is known to be idle or still on stale data.
+  void clear() {
+    tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+  }
+
+private:
+  char buf[size];
+  std::atomic<uint32_t> head = 0; // Written by the producer only
+  std::atomic<uint32_t> tail = 0; // Written by the consumer only
+};
+
+//------------------------------------------------------------------------------
@@ -4,48 +4,64 @@
 #include <string.h>
 
 #include "utils.h"
+#include "debug_defines.h"
 
-static const int breakpoint_max = 32;
-static const int page_size = 64;
-static const uint32_t BP_EMPTY = 0xDEADBEEF;
+// Breakpoints are kept sorted by address so lookups are a binary search.
+static const int breakpoint_max = 512;
+
+// We keep two copies of the flash we can patch, so on the larger parts we
+// only cover the start of flash with software breakpoints.
+static const int mirror_max = 32 * 1024;
 
 //------------------------------------------------------------------------------
 
-SoftBreak::SoftBreak(RVDebug* rvd, WCHFlash* flash) : rvd(rvd), flash(flash) {
+SoftBreak::SoftBreak(RVDebug* rvd, WCHFlash* flash, const WCHChip& chip)
+: rvd(rvd), flash(flash) {
+  ram_base = chip.get_ram_base();
+  ram_size = chip.ram_size;
+
   breakpoints = new uint32_t[breakpoint_max];
 
   // FIXME - Yes, we're creating two buffers the size of the entire target
   // flash memory. For small MCUs like the CH32V003 this is OK, larger MCUs
-  // will need to do something different.
+  // only get the first mirror_max bytes.
 
-  int flash_size = flash->get_flash_size();
-  flash_dirty = new uint8_t[flash_size];
-  flash_clean = new uint8_t[flash_size];
+  page_size = flash->get_page_size();
+  mirror_size = flash->get_flash_size();
+  if (mirror_size > mirror_max) mirror_size = mirror_max;
 
-  int page_count = flash->get_page_count();
+  flash_dirty = new uint8_t[mirror_size];
+  flash_clean = new uint8_t[mirror_size];
+
+  int page_count = mirror_size / page_size;
   break_map = new uint8_t[page_count];
   flash_map = new uint8_t[page_count];
   dirty_map = new uint8_t[page_count];
+  plan_map = new uint8_t[page_count];
+  device_hash = new uint32_t[page_count];
+
+  flash->set_listener(this);
+  emu = new RVEmu(rvd, this);
 }
 
 //------------------------------------------------------------------------------
 
 void SoftBreak::init() {
   breakpoint_count = 0;
-  for (int i = 0; i < breakpoint_max; i++) {
-    breakpoints[i] = BP_EMPTY;
-  }
+  ram_break_count = 0;
+  ram_patched = false;
 
-  // FIXME - Do we want to grab a full copy of target flash here? It would save
-  // us some bookkeeping later, at the cost of a slightly slower startup.
-  int flash_size = flash->get_flash_size();
-  memset(flash_dirty, 0, flash_size);
-  memset(flash_clean, 0, flash_size);
+  // The target may be running here, so the full copy of flash waits for
+  // snapshot() when GDB attaches.
+  snapshot_valid = false;
+  memset(flash_dirty, 0, mirror_size);
+  memset(flash_clean, 0, mirror_size);
 
-  int page_count = flash->get_page_count();
+  int page_count = mirror_size / page_size;
   memset(break_map, 0, page_count);
   memset(flash_map, 0, page_count);
   memset(dirty_map, 0, page_count);
+  memset(device_hash, 0, page_count * sizeof(device_hash[0]));
 
   halted = rvd->get_dmstatus().ALLHALTED;
 }
@@ -53,20 +69,22 @@ void SoftBreak::init() {
 //------------------------------------------------------------------------------
 
 void SoftBreak::dump() {
-  int flash_size = flash->get_flash_size();
-  int page_count = flash->get_page_count();
+  int page_count = mirror_size / page_size;
 
   printf_b("status\n");
   printf("  halted %d\n", halted);
   printf("  DPC 0x%08x\n", rvd->get_dpc());
-  printf("  breakpoint_count %d\n");
+  printf("  breakpoint_count %d\n", breakpoint_count);
 
   printf_b("breakpoints\n");
-  for (int y = 0; y < (breakpoint_max / 8); y++) {
-    for (int x = 0; x < 8; x++) {
-      printf("  0x%08x", breakpoints[x + y * 8]);
-    }
-    printf("\n");
+  for (int i = 0; i < breakpoint_count; i++) {
+    printf("  0x%08x", breakpoints[i]);
+    if ((i % 8) == 7 || i == breakpoint_count - 1) printf("\n");
+  }
+
+  printf_b("ram breakpoints\n");
+  for (int i = 0; i < ram_break_count; i++) {
+    printf("  0x%08x size %d\n", ram_break_addr[i], ram_break_size[i]);
   }
 
   printf_b("break_map\n");
@@ -117,6 +135,99 @@ void SoftBreak::dump() {
 }
 
 
+//------------------------------------------------------------------------------
+
+void SoftBreak::snapshot() {
+  CHECK(halted);
+
+  // Lazy unpatching may have left breakpoints on the chip, take them out
+  // first. Pages with breakpoints already have flash_dirty set up.
+  unpatch_flash();
+  rvd->get_block_aligned(flash->get_flash_base(), flash_clean, mirror_size);
+
+  int page_count = mirror_size / page_size;
+  for (int page = 0; page < page_count; page++) {
+    int page_base = page * page_size;
+    if (!break_map[page]) {
+      memcpy(flash_dirty + page_base, flash_clean + page_base, page_size);
+    }
+    device_hash[page] = page_hash(flash_clean + page_base);
+  }
+
+  snapshot_valid = true;
+}
+
+//------------------------------------------------------------------------------
+
+const uint8_t* SoftBreak::get_clean_flash(uint32_t addr, int size) {
+  if (!snapshot_valid) return nullptr;
+  if (addr > mirror_size || size > mirror_size - (int)addr) return nullptr;
+  return flash_clean + addr;
+}
+
+//------------------------------------------------------------------------------
+
+void SoftBreak::on_flash_write(uint32_t addr, const void* data, int size) {
+  if (!patching) update_mirror(addr, (const uint8_t*)data, size);
+}
+
+void SoftBreak::on_flash_erase(uint32_t addr, int size) {
+  if (!patching) update_mirror(addr, nullptr, size);
+}
+
+//----------
+// Someone else changed flash. Update our clean copy, and update the dirty copy
+// without losing any breakpoints in it. A null 'data' means erased.
+
+void SoftBreak::update_mirror(uint32_t addr, const uint8_t* data, int size) {
+  if (addr >= (uint32_t)mirror_size) return;
+  if (size > mirror_size - (int)addr) size = mirror_size - addr;
+
+  if (data) {
+    memcpy(flash_clean + addr, data, size);
+  }
+  else {
+    memset(flash_clean + addr, 0xFF, size);
+  }
+
+  int first_page = addr / page_size;
+  int last_page = (addr + size - 1) / page_size;
+  for (int page = first_page; page <= last_page; page++) {
+    int page_base = page * page_size;
+    int begin = page_base > (int)addr ? page_base : addr;
+    int end = page_base + page_size < (int)addr + size ? page_base + page_size : addr + size;
+
+    if (!break_map[page]) {
+      memcpy(flash_dirty + begin, flash_clean + begin, end - begin);
+    }
+    else {
+      // Copy the new contents around the breakpoints already in flash_dirty.
+      // Their size is whatever we wrote there when they were set.
+      int cursor = begin;
+      for (int i = find_breakpoint(begin); i < breakpoint_count && (int)breakpoints[i] < end; i++) {
+        int bp = breakpoints[i];
+        int bp_size = *(uint16_t*)(flash_dirty + bp) == 0x9002 ? 2 : 4;
+        if (bp > cursor) memcpy(flash_dirty + cursor, flash_clean + cursor, bp - cursor);
+        cursor = bp + bp_size;
+      }
+      if (end > cursor) memcpy(flash_dirty + cursor, flash_clean + cursor, end - cursor);
+    }
+
+    // If the whole page was written, or it had no breakpoints on the chip,
+    // the chip now holds the new clean contents. A partial write to a page
+    // that's still patched leaves us not knowing exactly what's there.
+    if (end - begin == page_size || !flash_map[page]) {
+      flash_map[page] = 0;
+      device_hash[page] = page_hash(flash_clean + page_base);
+      dirty_map[page] = break_map[page] ? 1 : 0;
+    }
+    else {
+      device_hash[page] = 0;
+      dirty_map[page] = 1;
+    }
+  }
+}
+
 //------------------------------------------------------------------------------
 
 void SoftBreak::halt() {
@@ -124,7 +235,8 @@ void SoftBreak::halt() {
   halted = true;
 
   rvd->halt();
-  unpatch_flash();
+  unpatch_ram();
+  if (!lazy_unpatch) unpatch_flash();
 }
 
 //------------------------------------------------------------------------------
@@ -141,22 +253,13 @@ bool SoftBreak::resume() {
   uint32_t dpc = rvd->get_dpc();
   LOG("resuming, dpc is at 0x%08x\n", dpc);
 
-  for (int i = 0; i < breakpoint_max; i++) {
-    if (breakpoints[i] != BP_EMPTY) {
-      LOG("breakpoint at 0x%08x\n", breakpoints[i]);
-    }
-  }
-
-  bool on_breakpoint = false;
-  for (int i = 0; i < breakpoint_max; i++) {
-    if (breakpoints[i] == dpc) {
-      on_breakpoint = true;
-      break;
-    }
+  for (int i = 0; i < breakpoint_count; i++) {
+    LOG("breakpoint at 0x%08x\n", breakpoints[i]);
   }
 
-  if (!on_breakpoint) {
+  if (!has_breakpoint(dpc)) {
     patch_flash();
+    patch_ram();
     halted = false;
     rvd->resume();
     return true;
@@ -171,10 +274,47 @@ bool SoftBreak::resume() {
 //------------------------------------------------------------------------------
 
 void SoftBreak::set_dpc(uint32_t pc) { rvd->set_dpc(pc); }
-void SoftBreak::step()           { rvd->step(); }
+
 bool SoftBreak::is_halted()      { return halted; }
 void SoftBreak::reset()      { rvd->reset(); }
 
+//----------
+// Execute triggers fire before the instruction runs, so stepping off one
+// needs it out of the way for that one step.
+
+void SoftBreak::step() {
+  int slot = -1;
+  if (trigger_count) {
+    uint32_t dpc = rvd->get_dpc();
+    slot = find_trigger(dpc, CSR_MCONTROL_EXECUTE);
+  }
+
+  // With lazy unpatching the instruction under dpc may still be one of our
+  // ebreaks. If so we run the original instruction from flash_clean in the
+  // emulator and leave the breakpoint where it is. Only if the emulator can't
+  // handle it does the page have to go back to clean for a real step.
+  if (lazy_unpatch) {
+    uint32_t dpc = rvd->get_dpc();
+    uint32_t offset = (dpc & 0xFF000000) == 0x08000000 ? dpc & 0x00FFFFFF : dpc;
+    if (offset + 2 <= (uint32_t)mirror_size && flash_map[offset / page_size]) {
+      uint16_t insn  = rvd->get_mem_u16(offset);
+      uint16_t clean = *(uint16_t*)(flash_clean + offset);
+      if (insn != clean && (insn == 0x9002 || insn == 0x0073)) {
+        uint32_t orig = clean;
+        bool whole = (clean & 3) != 3 || offset + 4 <= (uint32_t)mirror_size;
+        if ((clean & 3) == 3 && whole) memcpy(&orig, flash_clean + offset, 4);
+
+        if (whole && emu->step(dpc, orig)) return;
+        unpatch_page(offset / page_size);
+      }
+    }
+  }
+
+  if (slot != -1) rvd->clear_trigger(slot);
+  rvd->step();
+  if (slot != -1) rvd->set_trigger(slot, trigger_tdata1[slot], trigger_tdata2[slot]);
+}
+
 //------------------------------------------------------------------------------
 
 int SoftBreak::set_breakpoint(uint32_t addr, int size) {
@@ -184,40 +324,48 @@ int SoftBreak::set_breakpoint(uint32_t addr, int size) {
     LOG_R("SoftBreak::set_breakpoint - Bad breakpoint size %d\n", size);
     return -1;
   }
-  if (addr >= 0x4000 - size) {
+  if (addr & 1) {
     LOG_R("SoftBreak::set_breakpoint - Address 0x%08x invalid\n", addr);
     return -1;
   }
-  if (addr & 1) {
-    LOG_R("SoftBreak::set_breakpoint - Address 0x%08x invalid\n", addr);
+  if (has_breakpoint(addr)) {
+    LOG_R("Breakpoint at 0x%08x already set\n", addr);
     return -1;
   }
 
-  int bp_index = -1;
-  for (int i = 0; i < breakpoint_max; i++) {
-    if (breakpoints[i] == BP_EMPTY && bp_index == -1) {
-      bp_index = i;
-    }
-    if (breakpoints[i] == addr) {
-      LOG_R("Breakpoint at 0x%08x already set\n", addr);
-      return -1;
-    }
+  // Hardware triggers first, they cost nothing on resume/halt.
+  if (set_trigger(addr, CSR_MCONTROL_EXECUTE) != -1) {
+    return breakpoint_max;
+  }
+
+  if (in_ram(addr, size)) {
+    return set_ram_break(addr, size);
   }
 
-  if (bp_index == -1) {
+  if (addr > mirror_size - size) {
+    LOG_R("SoftBreak::set_breakpoint - Address 0x%08x invalid\n", addr);
+    return -1;
+  }
+
+  int bp_index = find_breakpoint(addr);
+
+  if (breakpoint_count == breakpoint_max) {
     LOG_R("SoftBreak::set_breakpoint() - No valid slots left\n");
     return -1;
   }
 
   // Store the breakpoint
   int page = addr / page_size;
+  memmove(breakpoints + bp_index + 1, breakpoints + bp_index,
+          (breakpoint_count - bp_index) * sizeof(breakpoints[0]));
   breakpoints[bp_index] = addr;
   breakpoint_count++;
   break_map[page]++;
-  dirty_map[page]++;
+  dirty_map[page] = 1;
 
-  // If this is the first breakpoint in a page, save a clean copy of it.
-  if (break_map[page] == 1) {
+  // If this is the first breakpoint in a page and we don't have a snapshot,
+  // save a clean copy of it.
+  if (break_map[page] == 1 && !snapshot_valid) {
     int page_base = page * page_size;
     rvd->get_block_aligned(page_base, flash_clean + page_base, page_size);
     memcpy(flash_dirty + page_base, flash_clean + page_base, page_size);
@@ -248,7 +396,13 @@ int SoftBreak::clear_breakpoint(uint32_t addr, int size) {
     LOG_R("SoftBreak::set_breakpoint - Bad breakpoint size %d\n", size);
     return -1;
   }
-  if (addr >= 0x4000 - size) {
+  if (clear_trigger(addr, CSR_MCONTROL_EXECUTE) != -1) {
+    return breakpoint_max;
+  }
+  if (in_ram(addr, size)) {
+    return clear_ram_break(addr);
+  }
+  if (addr > mirror_size - size) {
     LOG_R("SoftBreak::clear_breakpoint - Address 0x%08x invalid\n", addr);
     return -1;
   }
@@ -257,15 +411,8 @@ int SoftBreak::clear_breakpoint(uint32_t addr, int size) {
     return -1;
   }
 
-  int bp_index = -1;
-  for (int i = 0; i < breakpoint_max; i++) {
-    if (breakpoints[i] == addr) {
-      bp_index = i;
-      break;
-    }
-  }
-
-  if (bp_index == -1) {
+  int bp_index = find_breakpoint(addr);
+  if (bp_index == breakpoint_count || breakpoints[bp_index] != addr) {
     LOG_R("SoftBreak::clear_breakpoint() - No breakpoint found at 0x%08x\n", addr);
     return -1;
   }
@@ -274,10 +421,11 @@ int SoftBreak::clear_breakpoint(uint32_t addr, int size) {
   int page = addr / page_size;
   CHECK(break_map[page]);
 
-  breakpoints[bp_index] = BP_EMPTY;
+  memmove(breakpoints + bp_index, breakpoints + bp_index + 1,
+          (breakpoint_count - bp_index - 1) * sizeof(breakpoints[0]));
   breakpoint_count--;
   break_map[page]--;
-  dirty_map[page]++;
+  dirty_map[page] = 1;
 
   // Restore breakpoint address in flash_dirty with original instruction
   if (size == 2) {
@@ -303,19 +451,236 @@ int SoftBreak::clear_breakpoint(uint32_t addr, int size) {
 void SoftBreak::clear_all_breakpoints() {
   CHECK(halted);
 
-  for (int i = 0; i < breakpoint_max; i++) {
-    breakpoints[i] = BP_EMPTY;
+  for (int i = 0; i < trigger_count; i++) {
+    if (trigger_tdata1[i]) rvd->clear_trigger(i);
+    trigger_tdata1[i] = 0;
   }
+
   breakpoint_count = 0;
+  ram_break_count = 0;
+
+  // Put the clean contents back in every page that had breakpoints, same as
+  // clearing them one at a time would.
+  int page_count = mirror_size / page_size;
+  for (int page = 0; page < page_count; page++) {
+    if (!break_map[page]) continue;
+    int page_base = page * page_size;
+    memcpy(flash_dirty + page_base, flash_clean + page_base, page_size);
+    break_map[page] = 0;
+    dirty_map[page] = 1;
+  }
 }
 
 //------------------------------------------------------------------------------
 
 bool SoftBreak::has_breakpoint(uint32_t addr) {
-  for (int i = 0; i < breakpoint_max; i++) {
-    if (breakpoints[i] == addr) return true;
+  if (find_trigger(addr, CSR_MCONTROL_EXECUTE) != -1) return true;
+  if (find_ram_break(addr) != -1) return true;
+  int i = find_breakpoint(addr);
+  return i < breakpoint_count && breakpoints[i] == addr;
+}
+
+//------------------------------------------------------------------------------
+// Code running from SRAM can take breakpoints without touching flash - we just
+// write ebreaks straight into RAM on resume and put the original instructions
+// back on halt. The originals are read at resume time, so anything GDB loaded
+// into RAM while halted is picked up.
+
+bool SoftBreak::in_ram(uint32_t addr, int size) {
+  return addr >= ram_base && addr - ram_base <= (uint32_t)(ram_size - size);
+}
+
+int SoftBreak::find_ram_break(uint32_t addr) {
+  for (int i = 0; i < ram_break_count; i++) {
+    if (ram_break_addr[i] == addr) return i;
   }
-  return false;
+  return -1;
+}
+
+int SoftBreak::set_ram_break(uint32_t addr, int size) {
+  if (ram_break_count == ram_break_max) {
+    LOG_R("SoftBreak::set_ram_break() - No valid slots left\n");
+    return -1;
+  }
+
+  int i = ram_break_count++;
+  ram_break_addr[i] = addr;
+  ram_break_size[i] = size;
+  ram_break_saved[i] = 0;
+  return i;
+}
+
+int SoftBreak::clear_ram_break(uint32_t addr) {
+  int i = find_ram_break(addr);
+  if (i == -1) {
+    LOG_R("SoftBreak::clear_ram_break() - No breakpoint found at 0x%08x\n", addr);
+    return -1;
+  }
+
+  ram_break_count--;
+  ram_break_addr[i]  = ram_break_addr[ram_break_count];
+  ram_break_size[i]  = ram_break_size[ram_break_count];
+  ram_break_saved[i] = ram_break_saved[ram_break_count];
+  return i;
+}
+
+//----------
+
+void SoftBreak::patch_ram() {
+  for (int i = 0; i < ram_break_count; i++) {
+    uint32_t addr = ram_break_addr[i];
+    if (ram_break_size[i] == 2) {
+      ram_break_saved[i] = rvd->get_mem_u16(addr);
+      rvd->set_mem_u16(addr, 0x9002); // c.ebreak
+    }
+    else {
+      ram_break_saved[i] = rvd->get_mem_u32(addr);
+      rvd->set_mem_u32(addr, 0x00100073); // ebreak
+    }
+  }
+  ram_patched = ram_break_count != 0;
+}
+
+//----------
+// If the program overwrote one of our ebreaks while it ran, whatever it wrote
+// is the instruction now and we leave it alone.
+
+void SoftBreak::unpatch_ram() {
+  if (!ram_patched) return;
+
+  for (int i = 0; i < ram_break_count; i++) {
+    uint32_t addr = ram_break_addr[i];
+    if (ram_break_size[i] == 2) {
+      if (rvd->get_mem_u16(addr) == 0x9002) rvd->set_mem_u16(addr, ram_break_saved[i]);
+    }
+    else {
+      if (rvd->get_mem_u32(addr) == 0x00100073) rvd->set_mem_u32(addr, ram_break_saved[i]);
+    }
+  }
+  ram_patched = false;
+}
+
+//------------------------------------------------------------------------------
+// Parts with Sdtrig (QingKe V4 and up) get hardware breakpoints. The CH32V003
+// has none and everything goes through flash patching.
+
+void SoftBreak::init_triggers() {
+  CHECK(halted);
+
+  trigger_count = rvd->count_triggers();
+  if (trigger_count > trigger_max) trigger_count = trigger_max;
+
+  // Drop anything a previous session left armed.
+  for (int i = 0; i < trigger_count; i++) {
+    rvd->clear_trigger(i);
+    trigger_tdata1[i] = 0;
+    trigger_addr[i] = 0;
+    trigger_len[i] = 0;
+    trigger_tdata2[i] = 0;
+  }
+
+  LOG("SoftBreak::init_triggers() - %d triggers\n", trigger_count);
+}
+
+//----------
+// 'match' is some combination of CSR_MCONTROL_EXECUTE/STORE/LOAD. Returns the
+// slot used, or -1 if there are no free triggers or the trigger can't cover
+// [addr, addr+len).
+//
+// Ranges use a NAPOT match, so 'len' has to be a power of two and 'addr'
+// aligned to it. Anything else is up to the caller.
+
+int SoftBreak::set_trigger(uint32_t addr, uint32_t match, int len) {
+  if (len < 1) len = 1;
+  if ((len & (len - 1)) || (addr & (len - 1))) return -1;
+
+  uint32_t tdata2 = len == 1 ? addr : addr | ((len >> 1) - 1);
+  uint32_t kind   = len == 1 ? 0 : CSR_MCONTROL_MATCH_NAPOT << CSR_MCONTROL_MATCH_OFFSET;
+
+  for (int i = 0; i < trigger_count; i++) {
+    if (trigger_tdata1[i]) continue;
+
+    // Enter debug mode on an address match in M and U mode. Newer parts may
+    // only take the mcontrol6 layout, whose low bits are the same.
+    uint32_t config = (1u << 27) | (1u << 12) | kind | CSR_MCONTROL_M | CSR_MCONTROL_U | match;
+    uint32_t tdata1 = (uint32_t(CSR_TDATA1_TYPE_MCONTROL) << 28) | config;
+    if (!rvd->set_trigger(i, tdata1, tdata2)) {
+      tdata1 = (uint32_t(CSR_TDATA1_TYPE_MCONTROL6) << 28) | config;
+      if (!rvd->set_trigger(i, tdata1, tdata2)) {
+        rvd->clear_trigger(i);
+        return -1;
+      }
+    }
+
+    trigger_tdata1[i] = tdata1;
+    trigger_tdata2[i] = tdata2;
+    trigger_addr[i] = addr;
+    trigger_len[i] = len;
+    return i;
+  }
+  return -1;
+}
+
+int SoftBreak::clear_trigger(uint32_t addr, uint32_t match, int len) {
+  int i = find_trigger(addr, match, len);
+  if (i != -1) {
+    rvd->clear_trigger(i);
+    trigger_tdata1[i] = 0;
+  }
+  return i;
+}
+
+//----------
+// After a halt, find the data trigger that fired (if any) and re-arm it, which
+// also clears its hit bit.
+
+int SoftBreak::find_hit_trigger() {
+  for (int i = 0; i < trigger_count; i++) {
+    if (!trigger_tdata1[i] || (trigger_tdata1[i] & CSR_MCONTROL_EXECUTE)) continue;
+
+    uint32_t tdata1 = 0;
+    if (!rvd->get_trigger(i, tdata1)) continue;
+
+    // mcontrol has one hit bit, mcontrol6 splits it in two.
+    uint32_t hit_mask = (tdata1 >> 28) == CSR_TDATA1_TYPE_MCONTROL6
+      ? ((1u << 22) | (1u << 25))
+      : (1u << 20);
+
+    if (tdata1 & hit_mask) {
+      rvd->set_trigger(i, trigger_tdata1[i], trigger_tdata2[i]);
+      return i;
+    }
+  }
+  return -1;
+}
+
+int SoftBreak::find_trigger(uint32_t addr, uint32_t match, int len) {
+  if (len < 1) len = 1;
+  for (int i = 0; i < trigger_count; i++) {
+    if (trigger_tdata1[i] && trigger_addr[i] == addr && trigger_len[i] == len &&
+        (trigger_tdata1[i] & 7) == match) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+//------------------------------------------------------------------------------
+// Index of the first breakpoint >= addr, or breakpoint_count if there is none.
+
+int SoftBreak::find_breakpoint(uint32_t addr) {
+  int lo = 0;
+  int hi = breakpoint_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (breakpoints[mid] < addr) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
 }
 
 //------------------------------------------------------------------------------
@@ -324,14 +689,36 @@ bool SoftBreak::has_breakpoint(uint32_t addr) {
 void SoftBreak::patch_flash() {
   CHECK(halted);
 
-  int page_count = flash->get_page_count();
+  int page_count = mirror_size / page_size;
+  int todo = 0;
   for (int page = 0; page < page_count; page++) {
+    plan_map[page] = 0;
     if (!dirty_map[page]) continue;
 
+    // No breakpoints wanted and none on the chip - the page is already clean.
+    if (!break_map[page] && !flash_map[page]) {
+      dirty_map[page] = 0;
+      continue;
+    }
+
+    // The chip already has exactly this page - GDB removed and reinserted
+    // the same breakpoints while we left them in flash.
+    if (device_has(page, flash_dirty)) {
+      flash_map[page] = break_map[page];
+      dirty_map[page] = 0;
+      continue;
+    }
+
     LOG("patching page %d to have %d breakpoints\n", page, break_map[page]);
-    int page_base = page * page_size;
-    flash->wipe_page(page_base);
-    flash->write_flash(page_base, flash_dirty + page_base, page_size);
+    plan_map[page] = 1;
+    todo++;
+  }
+  if (!todo) return;
+
+  write_pages(flash_dirty);
+
+  for (int page = 0; page < page_count; page++) {
+    if (!plan_map[page]) continue;
     flash_map[page] = break_map[page];
     dirty_map[page] = 0;
   }
@@ -343,17 +730,170 @@ void SoftBreak::patch_flash() {
 void SoftBreak::unpatch_flash() {
   CHECK(halted);
 
-  int page_count = flash->get_page_count();
+  int page_count = mirror_size / page_size;
+  int todo = 0;
   for (int page = 0; page < page_count; page++) {
+    plan_map[page] = 0;
     if (!flash_map[page]) continue;
 
+    if (device_has(page, flash_clean)) {
+      flash_map[page] = 0;
+      dirty_map[page] = 1;
+      continue;
+    }
+
     LOG("unpatching page %d\n", page);
-    int page_base = page * page_size;
-    flash->wipe_page(page_base);
-    flash->write_flash(page_base, flash_clean + page_base, page_size);
+    plan_map[page] = 1;
+    todo++;
+  }
+  if (!todo) return;
+
+  write_pages(flash_clean);
+
+  for (int page = 0; page < page_count; page++) {
+    if (!plan_map[page]) continue;
     flash_map[page] = 0;
     dirty_map[page] = 1;
   }
 }
 
 //------------------------------------------------------------------------------
+// Write every page marked in plan_map from 'image'. Runs of adjacent pages go
+// out as one erase_and_program() call. If enough pages in one sector change,
+// we erase the whole sector and rewrite all of it instead - pages that
+// weren't marked already hold what 'image' has for them, but that's only true
+// if we have a full snapshot of flash.
+
+void SoftBreak::write_pages(uint8_t* image) {
+  int page_count = mirror_size / page_size;
+  int sector_size = flash->get_sector_size();
+  int sector_pages = sector_size / page_size;
+  bool use_sectors = snapshot_valid && sector_pages > 1;
+
+  // True if 'page' starts a sector we should erase whole.
+  auto whole_sector = [&](int page) {
+    if (!use_sectors || (page % sector_pages) || page + sector_pages > page_count) return false;
+    int changed = 0;
+    for (int i = 0; i < sector_pages; i++) changed += plan_map[page + i] != 0;
+    return changed >= sector_threshold(sector_pages);
+  };
+
+  patching = true;
+  flash->begin_session();
+
+  int page = 0;
+  while (page < page_count) {
+    if (whole_sector(page)) {
+      LOG("rewriting sector at page %d\n", page);
+      int sector_base = page * page_size;
+      flash->wipe_sector(sector_base);
+      flash->write_flash(sector_base, image + sector_base, sector_size);
+      for (int i = 0; i < sector_pages; i++, page++) {
+        device_hash[page] = page_hash(image + page * page_size);
+      }
+      continue;
+    }
+
+    if (!plan_map[page]) {
+      page++;
+      continue;
+    }
+
+    // Extend the run up to the next sector we're going to erase whole.
+    int run_start = page;
+    page++;
+    while (page < page_count && plan_map[page] && !whole_sector(page)) {
+      page++;
+    }
+
+    int run_base = run_start * page_size;
+    flash->erase_and_program(run_base, image + run_base, (page - run_start) * page_size);
+    for (int i = run_start; i < page; i++) {
+      device_hash[i] = page_hash(image + i * page_size);
+    }
+  }
+
+  flash->end_session();
+  patching = false;
+}
+
+//------------------------------------------------------------------------------
+
+//----------
+// Put one page back to its clean contents right away.
+
+void SoftBreak::unpatch_page(int page) {
+  LOG("unpatching page %d\n", page);
+  for (int i = 0; i < mirror_size / page_size; i++) plan_map[i] = i == page;
+  write_pages(flash_clean);
+  flash_map[page] = 0;
+  dirty_map[page] = 1;
+}
+
+//------------------------------------------------------------------------------
+// FNV-1a over one page. Lets us tell whether the chip already holds a page
+// image without reading it back. Zero is reserved for "unknown".
+
+uint32_t SoftBreak::page_hash(const uint8_t* data) {
+  uint32_t h = 0x811C9DC5;
+  for (int i = 0; i < page_size; i++) {
+    h = (h ^ data[i]) * 0x01000193;
+  }
+  return h ? h : 1;
+}
+
+bool SoftBreak::device_has(int page, const uint8_t* image) {
+  if (!snapshot_valid || !device_hash[page]) return false;
+  return device_hash[page] == page_hash(image + page * page_size);
+}
+
+//------------------------------------------------------------------------------
+// GDB should see the program, not our ebreaks. Replace any bytes of 'buf'
+// that come from pages the chip currently has patched.
+
+void SoftBreak::overlay_clean(uint32_t addr, uint8_t* buf, int size) {
+  if ((addr & 0xFF000000) == 0x08000000) addr &= 0x00FFFFFF;
+
+  for (int i = 0; i < size; i++) {
+    uint32_t a = addr + i;
+    if (a >= (uint32_t)mirror_size) break;
+    if (flash_map[a / page_size]) buf[i] = flash_clean[a];
+  }
+}
+
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Memory the emulator may touch while stepping over a resident breakpoint.
+// Peripheral registers can have side effects on read and RVDebug's narrow
+// accesses are read-modify-write on the whole word, so only SRAM and our copy
+// of flash are allowed. Misaligned accesses are left to the hart too, so they
+// trap the same way they would have.
+
+bool SoftBreak::emu_load(uint32_t addr, int size, uint32_t& data) {
+  if (addr & (size - 1)) return false;
+
+  uint32_t offset = (addr & 0xFF000000) == 0x08000000 ? addr & 0x00FFFFFF : addr;
+  if (snapshot_valid && offset + size <= (uint32_t)mirror_size) {
+    data = 0;
+    memcpy(&data, flash_clean + offset, size);
+    return true;
+  }
+
+  if (!in_ram(addr, size)) return false;
+  if      (size == 1) data = rvd->get_mem_u8(addr);
+  else if (size == 2) data = rvd->get_mem_u16(addr);
+  else                data = rvd->get_mem_u32(addr);
+  return true;
+}
+
+bool SoftBreak::emu_store(uint32_t addr, int size, uint32_t data) {
+  if ((addr & (size - 1)) || !in_ram(addr, size)) return false;
+
+  if      (size == 1) rvd->set_mem_u8(addr, data);
+  else if (size == 2) rvd->set_mem_u16(addr, data);
+  else                rvd->set_mem_u32(addr, data);
+  return true;
+}
+
+//------------------------------------------------------------------------------
@@ -1,5 +1,6 @@
 // Software breakpoint support for WCH MCUs.
-// Patches flash to insert breakpoints on resume, unpatches flash on halt.
+// Patches flash to insert breakpoints on resume, unpatches flash on halt (or
+// in lazy mode, only once the breakpoint set changes).
 
 // Includes a small optimization to prevent excessive patch/unpatching - if the
 // next instruction is a breakpoint when we're about to resume the CPU, we skip
@@ -10,14 +11,30 @@
 #include "utils.h"
 #include "RVDebug.h"
 #include "WCHFlash.h"
+#include "WCHChip.h"
+#include "RVEmu.h"
 
 //------------------------------------------------------------------------------
 
-struct SoftBreak {
-  SoftBreak(RVDebug* rvd, WCHFlash* flash);
+struct SoftBreak : public FlashListener, public EmuBus {
+  SoftBreak(RVDebug* rvd, WCHFlash* flash, const WCHChip& chip);
   void init();
   void dump();
 
+  // Read all of the flash we cover into flash_clean in one go. After this,
+  // setting and clearing breakpoints never touches the chip, and WCHFlash
+  // keeps our copy up to date. Target must be halted.
+  void snapshot();
+
+  // Our copy of flash, or nullptr if we don't have a valid copy of that range.
+  const uint8_t* get_clean_flash(uint32_t addr, int size);
+
+  void on_flash_write(uint32_t addr, const void* data, int size) override;
+  void on_flash_erase(uint32_t addr, int size) override;
+
+  bool emu_load(uint32_t addr, int size, uint32_t& data) override;
+  bool emu_store(uint32_t addr, int size, uint32_t data) override;
+
   void halt();
   bool resume();
   void reset();
@@ -30,27 +47,91 @@ struct SoftBreak {
   int  clear_breakpoint(uint32_t addr, int size);
   void clear_all_breakpoints();
   bool has_breakpoint(uint32_t addr);
+
+  // Hardware triggers, probed when GDB attaches. Breakpoints use them first
+  // and only fall back to flash patching once they run out.
+  void init_triggers();
+  int  get_trigger_count() { return trigger_count; }
+  int  set_trigger(uint32_t addr, uint32_t match, int len = 1);
+  int  clear_trigger(uint32_t addr, uint32_t match, int len = 1);
+  int  find_trigger(uint32_t addr, uint32_t match, int len = 1);
+  int  find_hit_trigger();
+  uint32_t get_trigger_addr(int slot)  { return trigger_addr[slot]; }
+  uint32_t get_trigger_match(int slot) { return trigger_tdata1[slot] & 7; }
   void patch_flash();
   void unpatch_flash();
 
+  // In lazy mode (the default) halting leaves breakpoints in flash, and they
+  // only get rewritten when the breakpoint set changes - a stop/continue with
+  // the same breakpoints writes nothing. Memory reads must go through
+  // overlay_clean() so GDB doesn't see our ebreaks.
+  void set_lazy_unpatch(bool lazy) { lazy_unpatch = lazy; }
+  bool get_lazy_unpatch() { return lazy_unpatch; }
+  void overlay_clean(uint32_t addr, uint8_t* buf, int size);
+
   //----------------------------------------
 
 private:
 
   RVDebug* rvd;
   WCHFlash* flash;
+  RVEmu* emu;
+
+  void update_mirror(uint32_t addr, const uint8_t* data, int size);
 
   bool halted;
+  bool snapshot_valid = false;
+  bool patching = false; // Our own flash writes, don't mirror them
+  bool lazy_unpatch = true;
+
+  int page_size;
+  int mirror_size; // Bytes of flash covered by flash_clean/flash_dirty
+
+  int find_breakpoint(uint32_t addr);
+
+  bool in_ram(uint32_t addr, int size);
+  int  find_ram_break(uint32_t addr);
+  int  set_ram_break(uint32_t addr, int size);
+  int  clear_ram_break(uint32_t addr);
+  void patch_ram();
+  void unpatch_ram();
+  void write_pages(uint8_t* image);
+  void unpatch_page(int page);
+  uint32_t page_hash(const uint8_t* data);
+  bool device_has(int page, const uint8_t* image);
+
+  // Erasing a whole sector beats erasing this many of its pages one by one.
+  int sector_threshold(int sector_pages) { return sector_pages / 2; }
 
   int breakpoint_count;
-  uint32_t* breakpoints;
+  uint32_t* breakpoints; // Sorted by address
 
   uint8_t*  flash_clean; // Buffer for cached flash contents.
   uint8_t*  flash_dirty; // Buffer for cached flash contents w/ breakpoints inserted
 
+  uint32_t ram_base;
+  int      ram_size;
+
+  // Breakpoints in SRAM, written directly while the target runs.
+  static const int ram_break_max = 32;
+  int       ram_break_count = 0;
+  bool      ram_patched = false;
+  uint32_t  ram_break_addr[ram_break_max];
+  int       ram_break_size[ram_break_max];
+  uint32_t  ram_break_saved[ram_break_max]; // Original instruction while patched
+
+  static const int trigger_max = 16;
+  int       trigger_count = 0;
+  uint32_t  trigger_tdata1[trigger_max]; // 0 if the trigger is free
+  uint32_t  trigger_addr[trigger_max];
+  int       trigger_len[trigger_max];
+  uint32_t  trigger_tdata2[trigger_max]; // Address, with the NAPOT mask for ranges
+
   uint8_t*  break_map; // Number of breakpoints set, per page
   uint8_t*  flash_map; // Number of breakpoints written to device flash, per page.
   uint8_t*  dirty_map; // Nonzero if the flash page does not match our flash_dirty copy.
+  uint8_t*  plan_map;  // Pages the current patch/unpatch needs to write
+  uint32_t* device_hash; // page_hash() of what the chip holds per page, 0 if unknown
 };
 
 //------------------------------------------------------------------------------
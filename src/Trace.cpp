@@ -0,0 +1,408 @@
+#include "Trace.h"
+
+#include <string.h>
+
+#include "RVDebug.h"
+#include "SoftBreak.h"
+#include "utils.h"
+
+// Frame header - u16 tracepoint number, u32 size of the blocks that follow
+static const int frame_header = 6;
+
+// Longest 'M' block, bigger ranges get split
+static const int mem_block_max = 1024;
+
+enum {
+  FIND_PC,
+  FIND_TP,
+  FIND_INSIDE,
+  FIND_OUTSIDE,
+};
+
+//------------------------------------------------------------------------------
+
+Trace::Trace(RVDebug* rvd, SoftBreak* soft, AgentExpr* agent)
+: rvd(rvd), soft(soft), agent(agent) {
+  buf = new uint8_t[buf_size];
+}
+
+//------------------------------------------------------------------------------
+
+void Trace::init() {
+  if (running) stop();
+  tp_count = 0;
+  buf_used = 0;
+  frame_count = 0;
+  created = 0;
+  frame = -1;
+  stop_reason = "tnotrun";
+  stop_tp = 0;
+}
+
+//------------------------------------------------------------------------------
+
+Trace::Tracepoint* Trace::add_tracepoint(int num, uint32_t addr) {
+  if (running || tp_count == tp_max) return nullptr;
+
+  Tracepoint* tp = &tps[tp_count++];
+  memset(tp, 0, sizeof(*tp));
+  tp->num = num;
+  tp->addr = addr;
+  return tp;
+}
+
+Trace::Tracepoint* Trace::get_tracepoint(int num, uint32_t addr) {
+  for (int i = 0; i < tp_count; i++) {
+    if (tps[i].num == num && tps[i].addr == addr) return &tps[i];
+  }
+  return nullptr;
+}
+
+Trace::Tracepoint* Trace::find_tracepoint(uint32_t addr) {
+  for (int i = 0; i < tp_count; i++) {
+    if (tps[i].enabled && tps[i].addr == addr) return &tps[i];
+  }
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Tracepoints go in as ordinary SoftBreak breakpoints, sized to match the
+// instruction under them. If GDB already has a breakpoint there we share it.
+
+bool Trace::start() {
+  CHECK(soft->is_halted());
+
+  buf_used = 0;
+  frame_count = 0;
+  created = 0;
+  frame = -1;
+
+  for (int i = 0; i < tp_count; i++) {
+    Tracepoint& tp = tps[i];
+    tp.hits = 0;
+    tp.size = 0;
+    if (!tp.enabled || soft->has_breakpoint(tp.addr)) continue;
+
+    uint16_t insn = rvd->get_mem_u16(tp.addr);
+    soft->overlay_clean(tp.addr, (uint8_t*)&insn, 2);
+    int size = (insn & 3) == 3 ? 4 : 2;
+
+    if (soft->set_breakpoint(tp.addr, size) == -1) {
+      LOG_R("Trace::start - Can't set tracepoint %d at 0x%08x\n", tp.num, tp.addr);
+      stop("terror", tp.num);
+      return false;
+    }
+    tp.size = size;
+  }
+
+  running = true;
+  stop_reason = nullptr;
+  return true;
+}
+
+//----------
+
+void Trace::stop(const char* reason, int tp_num) {
+  CHECK(soft->is_halted());
+
+  for (int i = 0; i < tp_count; i++) {
+    if (tps[i].size) soft->clear_breakpoint(tps[i].addr, tps[i].size);
+    tps[i].size = 0;
+  }
+
+  running = false;
+  stop_reason = reason;
+  stop_tp = tp_num;
+}
+
+//------------------------------------------------------------------------------
+
+bool Trace::on_hit(uint32_t addr) {
+  if (!running) return false;
+  Tracepoint* tp = find_tracepoint(addr);
+  if (!tp) return false;
+
+  bool ours = tp->size != 0;
+
+  // Registers first - everything after this runs debug programs. The user
+  // copies skip over anything those have already clobbered.
+  uint32_t regs[33];
+  int gpr_count = rvd->get_gpr_count();
+  bool need_regs = tp->collect_regs;
+  for (int i = 0; i < tp->mem_count; i++) {
+    if (tp->mem_reg[i] != mem_absolute) need_regs = true;
+  }
+  if (need_regs) {
+    for (int i = 0; i < gpr_count; i++) regs[i] = rvd->get_user_gpr(i);
+    regs[gpr_count] = rvd->get_dpc();
+  }
+
+  if (tp->cond_len) {
+    int64_t result = 0;
+    // Like breakpoint conditions, a broken expression counts as true.
+    if (agent->eval(tp->cond, tp->cond_len, result) && !result) return ours;
+  }
+
+  int frame_base = buf_used;
+  buf_full = false;
+  created++;
+
+  uint16_t num = tp->num;
+  uint32_t size = 0;
+  put_bytes(&num, 2);
+  put_bytes(&size, 4);
+
+  if (tp->collect_regs) {
+    put_bytes("R", 1);
+    put_bytes(regs, (gpr_count + 1) * 4);
+  }
+
+  for (int i = 0; i < tp->mem_count; i++) {
+    uint32_t reg = tp->mem_reg[i];
+    uint32_t base = reg == mem_absolute ? 0
+                  : reg == 32 ? regs[gpr_count]
+                  : reg < (uint32_t)gpr_count ? regs[reg]
+                  : 0;
+    put_mem(base + tp->mem_offset[i], tp->mem_len[i]);
+  }
+
+  for (int i = 0; i < tp->expr_count; i++) {
+    int64_t result = 0;
+    agent->eval(tp->expr[i], tp->expr_len[i], result, this);
+  }
+
+  if (buf_full) {
+    buf_used = frame_base;
+    stop("tfull");
+    return ours;
+  }
+
+  size = buf_used - frame_base - frame_header;
+  memcpy(buf + frame_base + 2, &size, 4);
+  frame_count++;
+  tp->hits++;
+
+  if (tp->pass && tp->hits >= tp->pass) stop("tpasscount", tp->num);
+  return ours;
+}
+
+//----------
+// GDB's breakpoint and ours can't both be set, so whoever is there first owns
+// it. If GDB puts one on a tracepoint it takes over, and when GDB removes it
+// again we put ours back.
+
+void Trace::on_user_break(uint32_t addr, bool set) {
+  Tracepoint* tp = find_tracepoint(addr);
+  if (!tp || !running) return;
+
+  if (set) {
+    tp->size = 0;
+  }
+  else if (!tp->size) {
+    uint16_t insn = rvd->get_mem_u16(addr);
+    soft->overlay_clean(addr, (uint8_t*)&insn, 2);
+    int size = (insn & 3) == 3 ? 4 : 2;
+    if (soft->set_breakpoint(addr, size) != -1) tp->size = size;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void Trace::put_bytes(const void* src, int size) {
+  if (buf_full || size > buf_size - buf_used) {
+    buf_full = true;
+    return;
+  }
+  memcpy(buf + buf_used, src, size);
+  buf_used += size;
+}
+
+void Trace::put_mem(uint32_t addr, int len) {
+  while (len > 0 && !buf_full) {
+    uint16_t chunk = len > mem_block_max ? mem_block_max : len;
+    uint64_t addr64 = addr;
+    if (buf_size - buf_used < 11 + chunk) {
+      buf_full = true;
+      return;
+    }
+    put_bytes("M", 1);
+    put_bytes(&addr64, 8);
+    put_bytes(&chunk, 2);
+    read_target(addr, buf + buf_used, chunk);
+    buf_used += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+}
+
+void Trace::on_trace_mem(uint32_t addr, int size) {
+  put_mem(addr, size);
+}
+
+//----------
+
+void Trace::read_target(uint32_t addr, uint8_t* dst, int len) {
+  uint32_t src = addr;
+  uint8_t* cursor = dst;
+  int left = len;
+
+  while (left) {
+    if ((src & 3) == 0 && left >= 4) {
+      int chunk = left & ~3;
+      rvd->get_block_aligned(src, cursor, chunk);
+      src += chunk;
+      cursor += chunk;
+      left -= chunk;
+    }
+    else {
+      *cursor++ = rvd->get_mem_u8(src++);
+      left--;
+    }
+  }
+
+  soft->overlay_clean(addr, dst, len);
+}
+
+//------------------------------------------------------------------------------
+// Frames aren't indexed, we just walk the buffer. There aren't enough of them
+// for that to matter.
+
+uint8_t* Trace::get_frame_ptr(int n) {
+  if (n < 0 || n >= frame_count) return nullptr;
+  uint8_t* f = buf;
+  for (int i = 0; i < n; i++) {
+    uint32_t size;
+    memcpy(&size, f + 2, 4);
+    f += frame_header + size;
+  }
+  return f;
+}
+
+uint32_t Trace::get_frame_pc(uint8_t* f) {
+  uint16_t num;
+  memcpy(&num, f, 2);
+  for (int i = 0; i < tp_count; i++) {
+    if (tps[i].num == num) return tps[i].addr;
+  }
+  return 0;
+}
+
+//----------
+
+int Trace::select_frame(int n) {
+  uint8_t* f = get_frame_ptr(n);
+  if (!f) {
+    frame = -1;
+    return -1;
+  }
+
+  uint16_t num;
+  memcpy(&num, f, 2);
+  frame = n;
+  frame_tp = num;
+  return n;
+}
+
+int Trace::find_frame(int start, int kind, uint32_t a, uint32_t b) {
+  for (int n = start; n < frame_count; n++) {
+    uint8_t* f = get_frame_ptr(n);
+    uint16_t num;
+    memcpy(&num, f, 2);
+    uint32_t pc = get_frame_pc(f);
+
+    bool match = false;
+    switch (kind) {
+      case FIND_PC:      match = pc == a; break;
+      case FIND_TP:      match = num == a; break;
+      case FIND_INSIDE:  match = pc >= a && pc <= b; break;
+      case FIND_OUTSIDE: match = pc < a || pc > b; break;
+    }
+    if (match) return select_frame(n);
+  }
+  return select_frame(-1);
+}
+
+int Trace::find_frame_pc(uint32_t pc)   { return find_frame(frame + 1, FIND_PC, pc, 0); }
+int Trace::find_frame_tp(int num)       { return find_frame(frame + 1, FIND_TP, num, 0); }
+
+int Trace::find_frame_range(uint32_t start, uint32_t end, bool inside) {
+  return find_frame(frame + 1, inside ? FIND_INSIDE : FIND_OUTSIDE, start, end);
+}
+
+//------------------------------------------------------------------------------
+
+bool Trace::get_frame_regs(uint32_t* regs) {
+  uint8_t* f = get_frame_ptr(frame);
+  if (!f) return false;
+
+  uint32_t size;
+  memcpy(&size, f + 2, 4);
+  uint8_t* cursor = f + frame_header;
+  uint8_t* end = cursor + size;
+  int reg_size = (rvd->get_gpr_count() + 1) * 4;
+
+  while (cursor < end) {
+    if (*cursor == 'R') {
+      memcpy(regs, cursor + 1, reg_size);
+      return true;
+    }
+    else if (*cursor == 'M') {
+      uint16_t len;
+      memcpy(&len, cursor + 9, 2);
+      cursor += 11 + len;
+    }
+    else {
+      break;
+    }
+  }
+  return false;
+}
+
+//----------
+
+int Trace::read_frame_mem(uint32_t addr, uint8_t* dst, int len) {
+  uint8_t* f = get_frame_ptr(frame);
+  if (!f) return 0;
+
+  uint32_t size;
+  memcpy(&size, f + 2, 4);
+  uint8_t* cursor = f + frame_header;
+  uint8_t* end = cursor + size;
+  int reg_size = (rvd->get_gpr_count() + 1) * 4;
+
+  while (cursor < end) {
+    if (*cursor == 'R') {
+      cursor += 1 + reg_size;
+    }
+    else if (*cursor == 'M') {
+      uint64_t block_addr;
+      uint16_t block_len;
+      memcpy(&block_addr, cursor + 1, 8);
+      memcpy(&block_len, cursor + 9, 2);
+
+      if (addr >= block_addr && addr < block_addr + block_len) {
+        int offset = addr - uint32_t(block_addr);
+        int avail = block_len - offset;
+        if (len > avail) len = avail;
+        memcpy(dst, cursor + 11 + offset, len);
+        return len;
+      }
+      cursor += 11 + block_len;
+    }
+    else {
+      break;
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+int Trace::read_buffer(int offset, uint8_t* dst, int len) {
+  if (offset < 0 || offset >= buf_used || len <= 0) return 0;
+  if (len > buf_used - offset) len = buf_used - offset;
+  memcpy(dst, buf + offset, len);
+  return len;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,131 @@
+// GDB tracepoints. GDBServer parses the QT*/qT* packets into tracepoint
+// definitions here; once tracing starts, each tracepoint is a breakpoint that
+// collects registers and memory into a trace buffer on the Pico and lets the
+// target run on. GDB browses the frames afterwards with QTFrame.
+//
+// Frames use gdbserver's layout - a u16 tracepoint number, a u32 size, then
+// 'R' (register block) and 'M' (u64 address, u16 length, data) blocks - so
+// qTBuffer can hand the buffer to "tsave" as is.
+
+#pragma once
+#include <stdint.h>
+#include "AgentExpr.h"
+
+struct RVDebug;
+struct SoftBreak;
+
+//------------------------------------------------------------------------------
+
+struct Trace : public TraceSink {
+  Trace(RVDebug* rvd, SoftBreak* soft, AgentExpr* agent);
+
+  // QTinit - forget all tracepoints and frames. Stops tracing first.
+  void init();
+
+  static const int tp_max = 8;
+  static const int code_max = 64;  // Bytes per condition or action expression
+  static const int mem_max = 4;    // "M" actions per tracepoint
+  static const int expr_max = 4;   // "X" actions per tracepoint
+
+  struct Tracepoint {
+    int      num;
+    uint32_t addr;
+    bool     enabled;
+    int      pass;      // Stop tracing after this many hits, 0 = never
+    int      hits;
+    int      size;      // Size of the breakpoint we set, 0 if GDB owns it
+
+    int      cond_len;  // 0 if unconditional
+    uint8_t  cond[code_max];
+
+    bool     collect_regs;
+    int      mem_count;
+    uint32_t mem_reg[mem_max];     // Base register, or mem_absolute
+    uint32_t mem_offset[mem_max];
+    int      mem_len[mem_max];
+    int      expr_count;
+    int      expr_len[expr_max];
+    uint8_t  expr[expr_max][code_max];
+  };
+
+  static const uint32_t mem_absolute = 0xFFFFFFFF;
+
+  // Definitions - only while tracing is stopped.
+  Tracepoint* add_tracepoint(int num, uint32_t addr);
+  Tracepoint* get_tracepoint(int num, uint32_t addr);
+
+  // Target must be halted for both, they set and clear breakpoints.
+  bool start();
+  void stop(const char* reason = "tstop", int tp_num = 0);
+
+  bool is_running() { return running; }
+
+  // Breakpoint hit at 'addr' while tracing. Collects a frame for any
+  // tracepoint there, and returns true if the target should keep running
+  // (the breakpoint is ours and not GDB's).
+  bool on_hit(uint32_t addr);
+
+  // GDB set or cleared a breakpoint of its own at 'addr'.
+  void on_user_break(uint32_t addr, bool set);
+
+  // Frames
+  int  get_frame_count()  { return frame_count; }
+  int  get_frame()        { return frame; }
+  int  get_frame_tp()     { return frame_tp; }
+  int  get_buffer_used()  { return buf_used; }
+  int  get_buffer_size()  { return buf_size; }
+  int  get_created()      { return created; }
+  const char* get_stop_reason() { return stop_reason; }
+  int  get_stop_tp()      { return stop_tp; }
+
+  // Selects frame 'n' (-1 for none), or the next frame after the current one
+  // matching one of the QTFrame searches. Returns the frame number or -1.
+  int  select_frame(int n);
+  int  find_frame_pc(uint32_t pc);
+  int  find_frame_tp(int num);
+  int  find_frame_range(uint32_t start, uint32_t end, bool inside);
+
+  // Reads from the selected frame. get_frame_regs returns false if the frame
+  // has no registers, read_frame_mem returns how many bytes starting at
+  // 'addr' the frame has.
+  bool get_frame_regs(uint32_t* regs);
+  int  read_frame_mem(uint32_t addr, uint8_t* dst, int len);
+
+  // Raw trace buffer, for qTBuffer.
+  int  read_buffer(int offset, uint8_t* dst, int len);
+
+  void on_trace_mem(uint32_t addr, int size) override;
+
+private:
+
+  Tracepoint* find_tracepoint(uint32_t addr);
+  uint8_t* get_frame_ptr(int n);
+  uint32_t get_frame_pc(uint8_t* f);
+  int  find_frame(int start, int kind, uint32_t a, uint32_t b);
+  void put_bytes(const void* src, int size);
+  void put_mem(uint32_t addr, int len);
+  void read_target(uint32_t addr, uint8_t* dst, int len);
+
+  RVDebug*   rvd;
+  SoftBreak* soft;
+  AgentExpr* agent;
+
+  Tracepoint tps[tp_max];
+  int        tp_count = 0;
+
+  bool running = false;
+  const char* stop_reason = "tnotrun";
+  int  stop_tp = 0;
+
+  static const int buf_size = 32 * 1024;
+  uint8_t* buf;
+  int  buf_used = 0;
+  bool buf_full = false;  // Set when the frame being collected doesn't fit
+
+  int  frame_count = 0;
+  int  created = 0;       // Frames collected, including ones that didn't fit
+  int  frame = -1;        // Selected frame, -1 for the live target
+  int  frame_tp = 0;
+};
+
+//------------------------------------------------------------------------------
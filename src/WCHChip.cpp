@@ -0,0 +1,90 @@
+#include "WCHChip.h"
+
+#include "RVDebug.h"
+#include "utils.h"
+
+#include <string.h>
+
+const uint32_t ADDR_ESIG_FLACAP  = 0x1FFFF7E0; // Flash capacity register 0xXXXX
+const uint32_t ADDR_ESIG_UNIID1  = 0x1FFFF7E8; // UID register 1 0xXXXXXXXX
+const uint32_t ADDR_ESIG_UNIID2  = 0x1FFFF7EC; // UID register 2 0xXXXXXXXX
+const uint32_t ADDR_ESIG_UNIID3  = 0x1FFFF7F0; // UID register 3 0xXXXXXXXX
+
+//------------------------------------------------------------------------------
+// The top bits of the part ID identify the family - 0x003xxxxx for CH32V003,
+// 0x203xxxxx for CH32V203 and so on. The flash and RAM sizes here are the
+// largest part in each family, the real flash size comes from ESIG_FLACAP and
+// the RAM size from ram_tab below.
+
+static const WCHChip chip_tab[] = {
+  // name        mask        partid      gprs  flash       ram        page  sector
+  { "CH32V003", 0xFFF00000, 0x00300000, 16,   16 * 1024,   2 * 1024,  64, 1024 },
+  { "CH32X035", 0xFFF00000, 0x03500000, 32,   62 * 1024,  20 * 1024, 256, 4096 },
+  { "CH32V103", 0xFF000000, 0x25000000, 32,   64 * 1024,  20 * 1024, 128, 1024 },
+  { "CH32V20x", 0xFF000000, 0x20000000, 32,  128 * 1024,  64 * 1024, 256, 4096 },
+  { "CH32V30x", 0xFF000000, 0x30000000, 32,  256 * 1024,  64 * 1024, 256, 4096 },
+};
+
+static const int chip_count = sizeof(chip_tab) / sizeof(chip_tab[0]);
+
+// RAM that goes with each flash size, for families that come in more than
+// one. The ESIG doesn't say, and these are the default flash/RAM splits from
+// the datasheets.
+
+static const struct {
+  const char* name;
+  int flash_kb;
+  int ram_kb;
+} ram_tab[] = {
+  { "CH32V103",  32, 10 },
+  { "CH32V103",  64, 20 },
+  { "CH32V20x",  32, 10 },
+  { "CH32V20x",  64, 20 },
+  { "CH32V20x", 128, 64 },
+  { "CH32V30x", 128, 32 },
+  { "CH32V30x", 256, 64 },
+};
+
+static const int ram_tab_count = sizeof(ram_tab) / sizeof(ram_tab[0]);
+
+//------------------------------------------------------------------------------
+
+WCHChip lookup_chip(uint32_t partid) {
+  for (int i = 0; i < chip_count; i++) {
+    if ((partid & chip_tab[i].partid_mask) == chip_tab[i].partid) {
+      return chip_tab[i];
+    }
+  }
+
+  LOG_R("lookup_chip() - Unknown part ID 0x%08x, assuming %s\n", partid, chip_tab[0].name);
+  return chip_tab[0];
+}
+
+//------------------------------------------------------------------------------
+
+void read_flash_size(RVDebug* rvd, WCHChip& chip) {
+  bool was_halted = rvd->get_dmstatus().ALLHALTED;
+  if (!was_halted) rvd->halt();
+
+  int flash_kb = rvd->get_mem_u16(ADDR_ESIG_FLACAP);
+
+  if (!was_halted) rvd->resume();
+
+  // Blank or garbage signature, or bigger than anything in the family. Stick
+  // with the table default.
+  if (flash_kb == 0 || flash_kb == 0xFFFF || flash_kb * 1024 > chip.flash_size) {
+    LOG_R("read_flash_size() - Bad ESIG_FLACAP 0x%04x\n", flash_kb);
+    return;
+  }
+
+  chip.flash_size = flash_kb * 1024;
+
+  for (int i = 0; i < ram_tab_count; i++) {
+    if (strcmp(ram_tab[i].name, chip.name) == 0 && ram_tab[i].flash_kb == flash_kb) {
+      chip.ram_size = ram_tab[i].ram_kb * 1024;
+      break;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,33 @@
+// Chip identification and memory geometry for the WCH RISC-V parts we support.
+
+#pragma once
+#include <stdint.h>
+
+struct RVDebug;
+
+//------------------------------------------------------------------------------
+
+struct WCHChip {
+  const char* name;
+  uint32_t partid_mask;
+  uint32_t partid;
+
+  int gpr_count;    // 16 on RV32E cores, 32 otherwise
+  int flash_size;   // Default, overridden by ESIG_FLACAP if it looks sane
+  int ram_size;
+  int page_size;    // Fast erase/program page
+  int sector_size;  // Standard erase sector
+
+  uint32_t get_flash_base() const { return 0x00000000; }
+  uint32_t get_ram_base()   const { return 0x20000000; }
+};
+
+// Looks up the chip from the WCH debug module part ID. Unknown parts get the
+// CH32V003 entry, as that's what everything was written against.
+WCHChip lookup_chip(uint32_t partid);
+
+// Reads the actual flash capacity out of the electronic signature, and sets
+// the RAM size to match. Briefly halts the target if it's running.
+void read_flash_size(RVDebug* rvd, WCHChip& chip);
+
+//------------------------------------------------------------------------------
@@ -4,11 +4,6 @@
 
 #include "pico/stdlib.h"
 
-const uint32_t ADDR_ESIG_FLACAP  = 0x1FFFF7E0; // Flash capacity register 0xXXXX
-const uint32_t ADDR_ESIG_UNIID1  = 0x1FFFF7E8; // UID register 1 0xXXXXXXXX
-const uint32_t ADDR_ESIG_UNIID2  = 0x1FFFF7EC; // UID register 2 0xXXXXXXXX
-const uint32_t ADDR_ESIG_UNIID3  = 0x1FFFF7F0; // UID register 3 0xXXXXXXXX
-
 const uint32_t ADDR_FLASH_ACTLR  = 0x40022000;
 const uint32_t ADDR_FLASH_KEYR   = 0x40022004;
 const uint32_t ADDR_FLASH_OBKEYR = 0x40022008;
@@ -20,10 +15,6 @@ const uint32_t ADDR_FLASH_WPR    = 0x40022020;
 const uint32_t ADDR_FLASH_MKEYR  = 0x40022024;
 const uint32_t ADDR_FLASH_BKEYR  = 0x40022028;
 
-//static const int ch32v003_flash_size = 16*1024;
-//static const int ch32v003_page_size  = 64;
-//static const int ch32v003_page_count = ch32v003_flash_size / ch32v003_page_size;
-
 //------------------------------------------------------------------------------
 
 struct Reg_FLASH_ACTLR {
@@ -171,9 +162,17 @@ static_assert(sizeof(Reg_FLASH_OBR) == 4);
 
 //------------------------------------------------------------------------------
 
-WCHFlash::WCHFlash(RVDebug* rvd, int flash_size) : rvd(rvd), flash_size(flash_size) {}
+WCHFlash::WCHFlash(RVDebug* rvd, const WCHChip& chip)
+: rvd(rvd),
+  flash_size(chip.flash_size),
+  page_size(chip.page_size),
+  sector_size(chip.sector_size) {
+}
 
-void WCHFlash::reset() {}
+void WCHFlash::reset() {
+  in_session = false;
+  unlocked = false;
+}
 
 //------------------------------------------------------------------------------
 
@@ -182,6 +181,7 @@ void WCHFlash::lock_flash() {
   ctlr.LOCK = true;
   ctlr.FLOCK = true;
   rvd->set_mem_u32(ADDR_FLASH_CTLR, ctlr);
+  unlocked = false;
 
   CHECK(Reg_FLASH_CTLR(rvd->get_mem_u32(ADDR_FLASH_CTLR)).LOCK, "Flash did not lock!");
   CHECK(Reg_FLASH_CTLR(rvd->get_mem_u32(ADDR_FLASH_CTLR)).FLOCK, "Flash did not lock fast mode!");
@@ -197,6 +197,7 @@ void WCHFlash::unlock_flash() {
 
   rvd->set_mem_u32(ADDR_FLASH_MKEYR, 0x45670123);
   rvd->set_mem_u32(ADDR_FLASH_MKEYR, 0xCDEF89AB);
+  unlocked = true;
 
   //CHECK(!Reg_FLASH_CTLR(rvd->get_mem_u32(ADDR_FLASH_CTLR)).LOCK, "Flash did not unlock!");
   //CHECK(!Reg_FLASH_CTLR(rvd->get_mem_u32(ADDR_FLASH_CTLR)).FLOCK, "Flash did not unlock fast mode!");
@@ -204,22 +205,75 @@ void WCHFlash::unlock_flash() {
 
 //------------------------------------------------------------------------------
 
+// Outside of a session we can't assume the chip hasn't been reset (and thus
+// relocked) since the last operation, so we unlock every time.
+
+void WCHFlash::prep_flash() {
+  if (!in_session || !unlocked) unlock_flash();
+}
+
+//------------------------------------------------------------------------------
+
 void WCHFlash::wipe_page(uint32_t dst_addr) {
-  unlock_flash();
+  prep_flash();
   dst_addr |= 0x08000000;
-  run_flash_command(dst_addr, BIT_CTLR_FTER, BIT_CTLR_FTER | BIT_CTLR_STRT);
+  load_flash_command(BIT_CTLR_FTER, BIT_CTLR_FTER | BIT_CTLR_STRT);
+  run_flash_command(dst_addr);
+  if (listener) listener->on_flash_erase(dst_addr & ~0x08000000, page_size);
 }
 
 void WCHFlash::wipe_sector(uint32_t dst_addr) {
-  unlock_flash();
+  prep_flash();
   dst_addr |= 0x08000000;
-  run_flash_command(dst_addr, BIT_CTLR_PER, BIT_CTLR_PER | BIT_CTLR_STRT);
+  load_flash_command(BIT_CTLR_PER, BIT_CTLR_PER | BIT_CTLR_STRT);
+  run_flash_command(dst_addr);
+  if (listener) listener->on_flash_erase(dst_addr & ~0x08000000, sector_size);
 }
 
 void WCHFlash::wipe_chip() {
-  unlock_flash();
+  prep_flash();
   uint32_t dst_addr = 0x08000000;
-  run_flash_command(dst_addr, BIT_CTLR_MER, BIT_CTLR_MER | BIT_CTLR_STRT);
+  load_flash_command(BIT_CTLR_MER, BIT_CTLR_MER | BIT_CTLR_STRT);
+  run_flash_command(dst_addr);
+  if (listener) listener->on_flash_erase(0, flash_size);
+}
+
+//------------------------------------------------------------------------------
+
+void WCHFlash::begin_session() {
+  if (in_session) return;
+  LOG("WCHFlash::begin_session()\n");
+  in_session = true;
+  unlock_flash();
+}
+
+void WCHFlash::end_session() {
+  if (!in_session) return;
+  LOG("WCHFlash::end_session()\n");
+  lock_flash();
+  in_session = false;
+}
+
+//------------------------------------------------------------------------------
+// Erases every page in [dst_addr, dst_addr + size) and then programs them.
+// The erase program and its registers are loaded once for the whole run, and
+// write_flash() streams all the pages with a single program load.
+
+void WCHFlash::erase_and_program(uint32_t dst_addr, void* blob, int size) {
+  LOG("WCHFlash::erase_and_program(0x%08x, 0x%08x, %d)\n", dst_addr, blob, size);
+
+  if ((dst_addr % page_size) || (size % page_size)) {
+    LOG_R("WCHFlash::erase_and_program() - Bad addr 0x%08x size %d\n", dst_addr, size);
+    return;
+  }
+
+  prep_flash();
+  load_flash_command(BIT_CTLR_FTER, BIT_CTLR_FTER | BIT_CTLR_STRT);
+  for (int offset = 0; offset < size; offset += page_size) {
+    run_flash_command((dst_addr + offset) | 0x08000000);
+  }
+
+  write_flash(dst_addr, blob, size);
 }
 
 //------------------------------------------------------------------------------
@@ -233,16 +287,72 @@ void WCHFlash::wipe_chip() {
 // good - 0x19e0006f
 // bad  - 0x00010040
 
+// Busy-waiting after every word takes 54443 us to write 564 bytes, busy-waiting
+// only at the end of each page takes 42847 us. The per-page version can drop
+// words if the debug module is still busy when the next one arrives, so in
+// fast mode we check CMDER at the end of every page and redo any page that
+// failed using the per-word version.
+
 void WCHFlash::write_flash(uint32_t dst_addr, void* blob, int size) {
   LOG("WCHFlash::write_flash(0x%08x, 0x%08x, %d)\n", dst_addr, blob, size);
-  unlock_flash();
+  prep_flash();
 
   if (size % 4) LOG_R("WCHFlash::write_flash() - Bad size %d\n", size);
   int size_dwords = size / 4;
+  int page_count = (size + page_size - 1) / page_size;
 
   dst_addr |= 0x08000000;
 
-  static const uint16_t prog_write_flash[16] = {
+  int page = 0;
+  while (page < page_count) {
+    int bad_page = stream_flash(dst_addr, blob, size_dwords, page, page_count, fast_write);
+    if (bad_page == -1) break;
+
+    LOG_R("WCHFlash::write_flash() - Page write failed at 0x%08x, retrying\n", dst_addr + bad_page * page_size);
+    rewrite_page(dst_addr, blob, size_dwords, bad_page);
+    page = bad_page + 1;
+  }
+
+  // Write 1 to clear EOP. Not sure if we need to do this...
+  auto statr = Reg_FLASH_STATR(rvd->get_mem_u32(ADDR_FLASH_STATR));
+  bool wrprterr = statr.WRPRTERR;
+  statr.EOP = 1;
+  rvd->set_mem_u32(ADDR_FLASH_STATR, statr);
+
+  // If the flash got relocked underneath us, nothing we wrote stuck. Find the
+  // pages that didn't make it and redo them the slow way.
+  if (wrprterr) {
+    LOG_R("WCHFlash::write_flash() - WRPRTERR set, verifying pages\n");
+    unlock_flash();
+    for (int page = 0; page < page_count; page++) {
+      int offset = page * page_size;
+      int len = (size - offset) < page_size ? (size - offset) : page_size;
+      if (!verify_flash(dst_addr + offset, (uint8_t*)blob + offset, len)) {
+        rewrite_page(dst_addr, blob, size_dwords, page);
+      }
+    }
+  }
+
+  if (listener) listener->on_flash_write(dst_addr & ~0x08000000, blob, size);
+
+  LOG("WCHFlash::write_flash() done\n");
+}
+
+//------------------------------------------------------------------------------
+// Erase and rewrite one page of a write_flash() call using the conservative
+// per-word busy-wait.
+
+void WCHFlash::rewrite_page(uint32_t dst_addr, void* blob, int size_dwords, int page) {
+  wipe_page(dst_addr + page * page_size);
+  stream_flash(dst_addr, blob, size_dwords, page, page + 1, false);
+}
+
+//------------------------------------------------------------------------------
+// Streams pages [first_page, last_page) of blob to flash at dst_addr. Returns
+// the index of the first page that failed, or -1 if they all went through.
+
+int WCHFlash::stream_flash(uint32_t dst_addr, void* blob, int size_dwords, int first_page, int last_page, bool per_page) {
+  uint16_t prog_write_flash[16] = {
     // Copy word and trigger BUFLOAD
     0x4180, // lw      s0,0(a1)
     0xc200, // sw      s0,0(a2)
@@ -255,8 +365,8 @@ void WCHFlash::write_flash(uint32_t dst_addr, void* blob, int size) {
 
     // Advance dest pointer and trigger START if we ended a page
     0x0611, // addi    a2,a2,4
-    0x7413, // andi    s0,a2,63
-    0x03f6, //
+    0x7413, // andi    s0,a2,(page_size - 1)
+    0x0006, //
     0xe419, // bnez    s0, <end>
     0xc918, // sw      a4,16(a0)
 
@@ -273,32 +383,36 @@ void WCHFlash::write_flash(uint32_t dst_addr, void* blob, int size) {
     0xc950, // sw      a2,20(a0)
   };
 
-  rvd->set_mem_u32(ADDR_FLASH_ADDR, dst_addr);
+  // Patch the page size into the immediate of the andi
+  prog_write_flash[8] |= (page_size - 1) << 4;
+
+  int page_dwords = page_size / 4;
+  uint32_t page_addr = dst_addr + first_page * page_size;
+
+  rvd->set_mem_u32(ADDR_FLASH_ADDR, page_addr);
   rvd->set_mem_u32(ADDR_FLASH_CTLR, BIT_CTLR_FTPG | BIT_CTLR_BUFRST);
 
   rvd->load_prog("write_flash", (uint32_t*)prog_write_flash, BIT_S0 | BIT_A0 | BIT_A1 | BIT_A2 | BIT_A3 | BIT_A4 | BIT_A5);
   rvd->set_gpr(10, 0x40022000); // flash base
   rvd->set_gpr(11, 0xE00000F4); // DATA0 @ 0xE00000F4
-  rvd->set_gpr(12, dst_addr);
+  rvd->set_gpr(12, page_addr);
   rvd->set_gpr(13, BIT_CTLR_FTPG | BIT_CTLR_BUFLOAD);
   rvd->set_gpr(14, BIT_CTLR_FTPG | BIT_CTLR_STRT);
   rvd->set_gpr(15, BIT_CTLR_FTPG | BIT_CTLR_BUFRST);
 
   bool first_word = true;
-  int page_count = (size_dwords + 15) / 16;
+  int bad_page = -1;
 
   // Start feeding dwords to prog_write_flash.
 
-  uint32_t busy_time = 0;
-
-  for (int page = 0; page < page_count; page++) {
-    for (int dword_idx = 0; dword_idx < 16; dword_idx++) {
-      int offset = (page * page_size) + (dword_idx * sizeof(uint32_t));
-      uint32_t* src = (uint32_t*)((uint8_t*)blob + offset);
+  for (int page = first_page; page < last_page; page++) {
+    for (int dword_idx = 0; dword_idx < page_dwords; dword_idx++) {
+      int src_idx = page * page_dwords + dword_idx;
+      uint32_t* src = (uint32_t*)blob + src_idx;
 
       // We have to write full pages only, so if we run out of source data we
       // write 0xDEADBEEF in the empty space.
-      rvd->set_data0(dword_idx < size_dwords ? *src : 0xDEADBEEF);
+      rvd->set_data0(src_idx < size_dwords ? *src : 0xDEADBEEF);
 
       if (first_word) {
         // There's a chip bug here - we can't set AUTOCMD before COMMAND or
@@ -309,35 +423,32 @@ void WCHFlash::write_flash(uint32_t dst_addr, void* blob, int size) {
         rvd->set_abstractauto(0x00000001);
         first_word = false;
       }
-      else {
-        // We can write flash slightly faster if we only busy-wait at the end
-        // of each page, but I am wary...
-        // Waiting here takes 54443 us to write 564 bytes
-        //uint32_t time_a = time_us_32();
+      else if (!per_page) {
         while (rvd->get_abstractcs().BUSY) {}
-        //uint32_t time_b = time_us_32();
-        //busy_time += time_b - time_a;
       }
     }
+
     // This is the end of a page
-    // Waiting here instead of the above takes 42847 us to write 564 bytes
-    //uint32_t time_a = time_us_32();
-    //while (rvd->get_abstractcs().BUSY) {}
-    //uint32_t time_b = time_us_32();
-    //busy_time += time_b - time_a;
+    if (per_page) {
+      Reg_ABSTRACTCS abstractcs;
+      do {
+        abstractcs = rvd->get_abstractcs();
+      } while (abstractcs.BUSY);
+
+      // Once CMDER is set the debug module ignores everything we send it, so
+      // there's no point continuing with the following pages.
+      if (abstractcs.CMDER) {
+        bad_page = page;
+        break;
+      }
+    }
   }
 
   rvd->set_abstractauto(0x00000000);
+  if (bad_page != -1) rvd->clear_err();
   rvd->set_mem_u32(ADDR_FLASH_CTLR, 0);
 
-  // Write 1 to clear EOP. Not sure if we need to do this...
-  auto statr = Reg_FLASH_STATR(rvd->get_mem_u32(ADDR_FLASH_STATR));
-  statr.EOP = 1;
-  rvd->set_mem_u32(ADDR_FLASH_STATR, statr);
-
-  //printf("busy_time %d\n", busy_time);
-
-  LOG("WCHFlash::write_flash() done\n");
+  return bad_page;
 }
 
 //------------------------------------------------------------------------------
@@ -429,7 +540,10 @@ void WCHFlash::dump() {
 
 //------------------------------------------------------------------------------
 
-void WCHFlash::run_flash_command(uint32_t addr, uint32_t ctl1, uint32_t ctl2) {
+// Loads the flash command program along with everything but the target
+// address, so a run of pages only needs one register write per page.
+
+void WCHFlash::load_flash_command(uint32_t ctl1, uint32_t ctl2) {
   static const uint16_t prog_flash_command[16] = {
     0xc94c, // sw      a1,20(a0)
     0xc910, // sw      a2,16(a0)
@@ -455,9 +569,12 @@ void WCHFlash::run_flash_command(uint32_t addr, uint32_t ctl1, uint32_t ctl2) {
 
   rvd->load_prog("flash_command", (uint32_t*)prog_flash_command, BIT_A0 | BIT_A1 | BIT_A2 | BIT_A3 | BIT_A5);
   rvd->set_gpr(10, 0x40022000);   // flash base
-  rvd->set_gpr(11, addr);
   rvd->set_gpr(12, ctl1);
   rvd->set_gpr(13, ctl2);
+}
+
+void WCHFlash::run_flash_command(uint32_t addr) {
+  rvd->set_gpr(11, addr);
   rvd->run_prog_slow();
 }
 
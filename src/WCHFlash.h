@@ -1,22 +1,35 @@
-// Small driver to read/write flash in the CH32V003 through the RVD interface
+// Small driver to read/write flash in WCH MCUs through the RVD interface
 
 #pragma once
 #include <stdint.h>
+#include "WCHChip.h"
 
 struct RVDebug;
 
+//------------------------------------------------------------------------------
+// Notified after every erase or write so that copies of flash kept elsewhere
+// (SoftBreak's mirror) stay in sync. Addresses are offsets from the start of
+// flash.
+
+struct FlashListener {
+  virtual void on_flash_write(uint32_t addr, const void* data, int size) = 0;
+  virtual void on_flash_erase(uint32_t addr, int size) = 0;
+};
+
 //------------------------------------------------------------------------------
 
 struct WCHFlash {
-  WCHFlash(RVDebug* rvd, int flash_size);
+  WCHFlash(RVDebug* rvd, const WCHChip& chip);
   void reset();
 
   uint32_t get_flash_base()  { return 0x00000000; }
   int get_flash_size()  { return flash_size; }
-  int get_page_size()   { return 64; }
-  int get_sector_size() { return 1024; }
+  int get_page_size()   { return page_size; }
+  int get_sector_size() { return sector_size; }
   int get_page_count()  { return get_flash_size() / get_page_size(); }
 
+  void set_listener(FlashListener* listener) { this->listener = listener; }
+
   // Lock/unlock flash. Assume flash always starts locked.
   void lock_flash();
   void unlock_flash();
@@ -28,17 +41,37 @@ struct WCHFlash {
 
   // Flash write, dest address must be aligned & size must be a multiple of 4
   void write_flash(uint32_t dst_addr, void* blob, int size);
+
+  // Fast mode only busy-waits at the end of each page instead of after every
+  // word. Pages that fail are redone in slow mode, so it's on by default.
+  void set_fast_write(bool fast) { fast_write = fast; }
   bool verify_flash(uint32_t dst_addr, void* blob, int size);
 
+  // Multi-page write sessions. Flash is unlocked once at the start of the
+  // session instead of once per operation, and erase_and_program() erases a
+  // whole run of pages before streaming the data for all of them in one go.
+  void begin_session();
+  void erase_and_program(uint32_t dst_addr, void* blob, int size);
+  void end_session();
+
   // Debug dump
   void dump();
 
 private:
-  void run_flash_command(uint32_t addr, uint32_t ctl1, uint32_t ctl2);
+  void prep_flash();
+  void load_flash_command(uint32_t ctl1, uint32_t ctl2);
+  void run_flash_command(uint32_t addr);
+  int  stream_flash(uint32_t dst_addr, void* blob, int size_dwords, int first_page, int last_page, bool per_page);
+  void rewrite_page(uint32_t dst_addr, void* blob, int size_dwords, int page);
 
   RVDebug* rvd;
+  FlashListener* listener = nullptr;
   const int flash_size;
-  static const int page_size = 64;
+  const int page_size;
+  const int sector_size;
+  bool in_session = false;
+  bool unlocked = false;
+  bool fast_write = true;
 };
 
 //------------------------------------------------------------------------------
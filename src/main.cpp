@@ -1,27 +1,107 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "tusb.h"
 
+#include <atomic>
+
 #include "PicoSWIO.h"
 #include "RVDebug.h"
+#include "WCHChip.h"
 #include "WCHFlash.h"
 #include "SoftBreak.h"
 #include "Console.h"
 #include "GDBServer.h"
+#include "SPSCQueue.h"
 #include "debug_defines.h"
 #include "utils.h"
 
 const int PIN_SWIO = 28;
 const int PIN_UART_TX = 0;
 const int PIN_UART_RX = 1;
-const int ch32v003_flash_size = 16*1024;
 
 void delay_us(int us) {
   auto now = time_us_32();
   while(time_us_32() < (now + us));
 }
 
+//------------------------------------------------------------------------------
+// Core 0 only services TinyUSB and shuffles bytes through these queues. Core 1
+// owns everything that talks to the debug link - the GDB stub and the console
+// - so a long flash write or memory dump never stalls USB.
+
+static SPSCQueue<4096> gdb_rx; // core 0 -> core 1
+static SPSCQueue<4096> gdb_tx; // core 1 -> core 0
+static std::atomic<bool> gdb_connected = false;
+
+// Bumped by core 0 whenever the CDC connection comes or goes. Core 1 drops
+// whatever it still has from the old session and copies it to gdb_session_ack,
+// and until then core 0 leaves both queues alone. Each side only clears the
+// queue it consumes from.
+static std::atomic<uint32_t> gdb_session = 0;
+static std::atomic<uint32_t> gdb_session_ack = 0;
+
+static GDBServer* gdb = nullptr;
+static Console* console = nullptr;
+
+void core1_main() {
+  console->start();
+
+  static char usb_in[CFG_TUD_CDC_RX_BUFSIZE];
+  static int  usb_in_size = 0;
+  static char usb_out[CFG_TUD_CDC_TX_BUFSIZE];
+
+  while (1) {
+
+    //----------------------------------------
+    // New connection or dropped one - tear down the old session even if we
+    // never saw it disconnect, and forget its unread bytes.
+
+    uint32_t session = gdb_session.load();
+    if (session != gdb_session_ack.load()) {
+      gdb->update(false, usb_in, 0);
+      gdb_rx.clear();
+      usb_in_size = 0;
+      gdb_session_ack.store(session);
+    }
+
+    //----------------------------------------
+    // Update GDB stub
+
+    // Anything the GDB stub doesn't consume yet stays in usb_in until the
+    // next pass.
+    usb_in_size += gdb_rx.get(usb_in + usb_in_size, sizeof(usb_in) - usb_in_size);
+
+    int used = gdb->update(gdb_connected.load(), usb_in, usb_in_size);
+    if (used) {
+      memmove(usb_in, usb_in + used, usb_in_size - used);
+      usb_in_size -= used;
+    }
+
+    // Encode as much of the reply as core 0 has room for.
+    int usb_out_max = gdb_tx.space();
+    if (usb_out_max > (int)sizeof(usb_out)) usb_out_max = sizeof(usb_out);
+
+    int usb_out_size = gdb->get_output(usb_out, usb_out_max);
+    if (usb_out_size) {
+      gdb_tx.put(usb_out, usb_out_size);
+    }
+
+    //----------------------------------------
+    // Update uart console
+
+    bool ser_ie = uart_is_readable(uart0);
+    char ser_in = 0;
+
+    if (ser_ie) {
+      uart_read_blocking(uart0, (uint8_t*)&ser_in, 1);
+    }
+    console->update(ser_ie, ser_in);
+  }
+}
+
 //------------------------------------------------------------------------------
 
 int main() {
@@ -36,75 +116,88 @@ int main() {
   PicoSWIO* swio = new PicoSWIO();
   swio->reset(PIN_SWIO);
 
+  printf_g("// Detecting chip\n");
+  WCHChip chip = lookup_chip(swio->get_partid());
+
   printf_g("// Starting RVDebug\n");
-  RVDebug* rvd = new RVDebug(swio, 16);
+  RVDebug* rvd = new RVDebug(swio, chip.gpr_count);
   rvd->init();
   //rvd->dump();
 
+  read_flash_size(rvd, chip);
+  printf_g("// Found %s, %d KB flash, %d KB RAM\n", chip.name, chip.flash_size / 1024, chip.ram_size / 1024);
+
   printf_g("// Starting WCHFlash\n");
-  WCHFlash* flash = new WCHFlash(rvd, ch32v003_flash_size);
+  WCHFlash* flash = new WCHFlash(rvd, chip);
   flash->reset();
   //flash->dump();
 
   printf_g("// Starting SoftBreak\n");
-  SoftBreak* soft = new SoftBreak(rvd, flash);
+  SoftBreak* soft = new SoftBreak(rvd, flash, chip);
   soft->init();
   //soft->dump();
 
   printf_g("// Starting GDBServer\n");
-  GDBServer* gdb = new GDBServer(rvd, flash, soft);
+  gdb = new GDBServer(chip, rvd, flash, soft);
   gdb->reset();
   //gdb->dump();
 
   printf_g("// Starting Console\n");
-  Console* console = new Console(rvd, flash, soft);
+  console = new Console(rvd, flash, soft);
   console->reset();
   //console->dump();
 
+  printf_g("// Starting TinyUSB\n");
+  tud_init(BOARD_TUD_RHPORT);
+
   printf_g("// Everything up and running!\n");
+  multicore_launch_core1(core1_main);
 
-  console->start();
   while (1) {
 
     //----------------------------------------
     // Update TinyUSB
 
-    static bool tud_init_done = false;
-    if (!tud_init_done) {
-      tud_init(BOARD_TUD_RHPORT);
-      tud_init_done = true;
-    }
     tud_task();
 
-    //----------------------------------------
-    // Update GDB stub
-
-    bool connected = tud_cdc_n_connected(0);
-    bool usb_ie = tud_cdc_n_available(0); // this "available" check is required for some reason
-    char usb_in = 0;
-    char usb_out = 0;
-    bool usb_oe = 0;
-
-    if (usb_ie) {
-      tud_cdc_n_read(0, &usb_in, 1);
+    static bool connected = false;
+    static bool tx_stale = false;
+    if (tud_cdc_n_connected(0) != connected) {
+      connected = !connected;
+      tud_cdc_n_read_flush(0);
+      tud_cdc_n_write_clear(0);
+      tx_stale = true;
+      gdb_connected.store(connected);
+      gdb_session.store(gdb_session.load() + 1);
     }
-    gdb->update(connected, usb_ie, usb_in, usb_oe, usb_out);
 
-    if (usb_oe) {
-      tud_cdc_n_write(0, &usb_out, 1);
-      tud_cdc_n_write_flush(0);
+    // Wait for core 1 to let go of the old session, then drop any replies it
+    // queued for it.
+    if (gdb_session_ack.load() != gdb_session.load()) continue;
+    if (tx_stale) {
+      gdb_tx.clear();
+      tx_stale = false;
     }
 
     //----------------------------------------
-    // Update uart console
+    // Move bytes between the CDC FIFOs and core 1
 
-    bool ser_ie = uart_is_readable(uart0);
-    char ser_in = 0;
+    static char usb_buf[CFG_TUD_CDC_TX_BUFSIZE];
 
-    if (ser_ie) {
-      uart_read_blocking(uart0, (uint8_t*)&ser_in, 1);
+    int in_max = gdb_rx.space();
+    if (in_max > (int)sizeof(usb_buf)) in_max = sizeof(usb_buf);
+    if (in_max && tud_cdc_n_available(0)) {
+      int in_size = tud_cdc_n_read(0, usb_buf, in_max);
+      gdb_rx.put(usb_buf, in_size);
+    }
+
+    int out_max = tud_cdc_n_write_available(0);
+    if (out_max > (int)sizeof(usb_buf)) out_max = sizeof(usb_buf);
+    int out_size = gdb_tx.get(usb_buf, out_max);
+    if (out_size) {
+      tud_cdc_n_write(0, usb_buf, out_size);
+      tud_cdc_n_write_flush(0);
     }
-    console->update(ser_ie, ser_in);
   }
 
   return 0;
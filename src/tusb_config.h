@@ -97,9 +97,10 @@
 #define CFG_TUD_MIDI              0
 #define CFG_TUD_VENDOR            0
 
-// CDC FIFO size of TX and RX
-#define CFG_TUD_CDC_RX_BUFSIZE   64
-#define CFG_TUD_CDC_TX_BUFSIZE   64
+// CDC FIFO size of TX and RX. These are big enough that most GDB packets go
+// through in one read or one write+flush.
+#define CFG_TUD_CDC_RX_BUFSIZE   1024
+#define CFG_TUD_CDC_TX_BUFSIZE   4096
 
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   64